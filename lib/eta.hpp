@@ -1,26 +1,32 @@
 // taken from https://tbz533.blogspot.com/2015/11/eta-for-c.html
 
-#include <ctime>
+#include <chrono>
 #include <cmath> // floor
 #include <iostream>
 
 class EtaEstimator {
 public:
     EtaEstimator(int N) : ct(0.0), etl(0.0), n(0), N(N) {
-	tick = clock();
+	tick = std::chrono::steady_clock::now();
     }
 
     // constuction starts the clock. Pass the number of steps
     void update() {
-	clock_t dt = clock() - tick;
-	tick += dt;
-	ct += (double(dt)/CLOCKS_PER_SEC); // prevent integer division
-	// CLOCKS_PER_SEC is defined in ctime
+	// wall clock time: clock() would add up the CPU time of every
+	// pipeline thread and overestimate the time left
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	ct += std::chrono::duration<double>(now - tick).count();
+	tick = now;
 	++n;
 	etl = (ct/n) * (N-n);
     }
 
     void print(std::ostream & os) const {
+	// unknown number of steps (e.g. a raw stream)
+	if(N <= 0) {
+	    os << "unknown";
+	    return;
+	}
 	double etlprime = etl;
 	int days = floor(etlprime / secperday);
 	etlprime -= days * secperday;
@@ -38,7 +44,7 @@ public:
 private:
     double ct, etl; // cumulative time, estimated time left
     int n, N; // steps taken, total amount of steps
-    clock_t tick; // time after update ((c) matlab)
+    std::chrono::steady_clock::time_point tick; // time after update ((c) matlab)
     // statics...
     static const int secperday = 86400;
     static const int secperhour = 3600;
@@ -0,0 +1,61 @@
+// Fixed capacity FIFO used to connect the stages of the processing
+// pipeline (decoder -> scorer -> writer). Producers block while the queue
+// is full, so a slow stage throttles the ones before it instead of letting
+// decoded frames pile up in memory.
+
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {
+    }
+
+    // blocks while the queue is full. Returns false if the queue was
+    // closed, in which case the item is dropped
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mtx);
+        not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+        if(closed)
+            return false;
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // blocks until an item is available. Returns false once the queue is
+    // closed and every pending item has been consumed
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mtx);
+        not_empty.wait(lock, [this] { return closed || !items.empty(); });
+        if(items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    // no more items will be pushed; consumers drain what is left
+    void close() {
+        std::lock_guard<std::mutex> lock(mtx);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mtx;
+    std::condition_variable not_empty, not_full;
+};
+
+#endif
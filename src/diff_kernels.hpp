@@ -0,0 +1,147 @@
+// Sum of absolute and of squared differences between two byte arrays,
+// the kernels of SadEngine and MseEngine. On x86-64 they use SSE2 or,
+// when the CPU has it, AVX2 (chosen at runtime, once); elsewhere a scalar
+// loop.
+
+#ifndef DIFF_KERNELS_HPP
+#define DIFF_KERNELS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define DIFF_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+typedef unsigned char uchar;
+
+// sum over i < n of |a[i] - b[i]|, or of (a[i] - b[i])^2
+typedef uint64_t (*DiffKernel)(const uchar *a, const uchar *b, size_t n);
+
+inline uint64_t sadScalar(const uchar *a, const uchar *b, size_t n)
+{
+    uint64_t sum = 0;
+    for(size_t i = 0; i < n; i++)
+        sum += std::abs(int(a[i]) - int(b[i]));
+    return sum;
+}
+
+inline uint64_t sseScalar(const uchar *a, const uchar *b, size_t n)
+{
+    uint64_t sum = 0;
+    for(size_t i = 0; i < n; i++) {
+        int d = int(a[i]) - int(b[i]);
+        sum += d * d;
+    }
+    return sum;
+}
+
+#ifdef DIFF_KERNELS_X86
+
+// bytes after which the 32-bit lanes of the squared difference kernels
+// are added to the 64-bit total: each 16 bytes add at most 4 * 255^2 to
+// a lane, so 32 KB stay far below 2^31
+size_t const SSE_CHUNK_BYTES = 32768;
+
+inline uint64_t sadSse2(const uchar *a, const uchar *b, size_t n)
+{
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+    }
+    uint64_t sum = _mm_cvtsi128_si64(acc) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+    return sum + sadScalar(a + i, b + i, n - i);
+}
+
+inline uint64_t sseSse2(const uchar *a, const uchar *b, size_t n)
+{
+    __m128i zero = _mm_setzero_si128();
+    uint64_t sum = 0;
+    size_t i = 0;
+    while(i + 16 <= n) {
+        size_t chunk_end = i + SSE_CHUNK_BYTES < n ? i + SSE_CHUNK_BYTES : n;
+        __m128i acc = _mm_setzero_si128();
+        for(; i + 16 <= chunk_end; i += 16) {
+            __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+            __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+            __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+            __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+        }
+        uint32_t lanes[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+        sum += uint64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    }
+    return sum + sseScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline uint64_t sadAvx2(const uchar *a, const uchar *b, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for(; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(va, vb));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sadScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline uint64_t sseAvx2(const uchar *a, const uchar *b, size_t n)
+{
+    uint64_t sum = 0;
+    size_t i = 0;
+    while(i + 16 <= n) {
+        size_t chunk_end = i + SSE_CHUNK_BYTES < n ? i + SSE_CHUNK_BYTES : n;
+        __m256i acc = _mm256_setzero_si256();
+        // 16 bytes at a time, widened to 16 16-bit values
+        for(; i + 16 <= chunk_end; i += 16) {
+            __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)));
+            __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)));
+            __m256i d = _mm256_sub_epi16(va, vb);
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+        }
+        uint32_t lanes[8];
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+        for(int l = 0; l < 8; l++)
+            sum += lanes[l];
+    }
+    return sum + sseScalar(a + i, b + i, n - i);
+}
+
+#endif
+
+struct DiffKernels {
+    DiffKernel sad;
+    DiffKernel sse;
+};
+
+// the fastest kernels this CPU runs
+inline const DiffKernels &diffKernels()
+{
+    static const DiffKernels kernels = [] {
+        DiffKernels k = {sadScalar, sseScalar};
+#ifdef DIFF_KERNELS_X86
+        k.sad = sadSse2;
+        k.sse = sseSse2;
+        if(__builtin_cpu_supports("avx2")) {
+            k.sad = sadAvx2;
+            k.sse = sseAvx2;
+        }
+#endif
+        return k;
+    }();
+    return kernels;
+}
+
+#endif
@@ -0,0 +1,113 @@
+// Pixel difference metrics between a frame and the reference images,
+// turned into similarities in [0, 1] (1 for identical images) so that the
+// same simThresh works as with NCC and SSIM:
+//
+//     SAD: 1 - mean(|a - b|) / 255
+//     MSE: 1 - sqrt(mean((a - b)^2)) / 255
+//
+// e.g. a threshold of 0.97 accepts a mean absolute difference (SAD) or
+// an RMS difference (MSE) of up to 7.65 gray levels. The references are
+// kept as they are (8-bit) and the frames are not transformed, so these
+// are the cheapest metrics; they are also the most sensitive to lighting
+// changes.
+//
+// The distances are summed by the SIMD kernels of diff_kernels.hpp, a
+// block of DIFF_BLOCK_BYTES at a time (about 8 rows of a 640x480 BGR
+// frame; bytes rather than rows since masked images are packed in a
+// single row, see roi_mask.hpp). After each block the running distance is
+// compared with the one that puts the similarity under the floor given by
+// the scorer: once it is over, the comparison stops and returns the
+// similarity of the partial distance, an upper bound of the real one that
+// is still under the floor.
+
+#ifndef DIFF_METRICS_HPP
+#define DIFF_METRICS_HPP
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "diff_kernels.hpp"
+
+size_t const DIFF_BLOCK_BYTES = 16384;
+
+// common part of SadEngine and MseEngine, see NccEngine for the interface
+// of the metric engines
+class PixelDiffEngine {
+public:
+    typedef cv::Mat Frame;
+    struct Workspace {};
+
+    // the references must all have the same size and type as the frames
+    // that will be scored
+    void setReferences(const std::vector<cv::Mat> &refImages) {
+        refs.resize(refImages.size());
+        for(size_t i = 0; i < refImages.size(); i++)
+            refs[i] = refImages[i].isContinuous() ? refImages[i] : refImages[i].clone();
+    }
+
+    void setReference(int i, const cv::Mat &img) {
+        refs[i] = img.clone();
+    }
+
+    int size() const {
+        return refs.size();
+    }
+
+    void prepare(const cv::Mat &frame, Frame &out) const {
+        out = frame.isContinuous() ? frame : frame.clone();
+    }
+
+protected:
+    // sum of kernel over frame and reference ref, stopping as soon as it
+    // goes over limit
+    uint64_t distance(DiffKernel kernel, const Frame &frame, int ref, double limit) const {
+        size_t n = frame.total() * frame.elemSize();
+        const uchar *a = frame.data;
+        const uchar *b = refs[ref].data;
+        uint64_t sum = 0;
+        for(size_t i = 0; i < n; i += DIFF_BLOCK_BYTES) {
+            sum += kernel(a + i, b + i, std::min(DIFF_BLOCK_BYTES, n - i));
+            if(sum > limit)
+                break;
+        }
+        return sum;
+    }
+
+    // the similarity sim of a comparison stopped over its limit, which is
+    // under floor, kept under it after the rounding to float: a partial
+    // distance close to the limit would otherwise give floor itself, which
+    // the scan takes for a match or a tie
+    static float underFloor(double sim, float floor) {
+        return std::min(float(sim), std::nextafter(floor, -1.0f));
+    }
+
+    std::vector<cv::Mat> refs;
+};
+
+class SadEngine : public PixelDiffEngine {
+public:
+    float score(const Frame &frame, int ref, Workspace &, float floor) const {
+        double n = frame.total() * frame.channels();
+        double limit = (1.0 - floor) * n * 255.0;
+        double sad = distance(diffKernels().sad, frame, ref, limit);
+        double sim = 1.0 - sad / (n * 255.0);
+        return sad > limit ? underFloor(sim, floor) : sim;
+    }
+};
+
+class MseEngine : public PixelDiffEngine {
+public:
+    float score(const Frame &frame, int ref, Workspace &, float floor) const {
+        double n = frame.total() * frame.channels();
+        double max_rms = std::max(0.0, 1.0 - floor) * 255.0;
+        double limit = n * max_rms * max_rms;
+        double sse = distance(diffKernels().sse, frame, ref, limit);
+        double sim = 1.0 - std::sqrt(sse / n) / 255.0;
+        return sse > limit ? underFloor(sim, floor) : sim;
+    }
+};
+
+#endif
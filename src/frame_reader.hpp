@@ -0,0 +1,232 @@
+// Reads and decodes the input frames of framesdiff ahead of the processing.
+//
+// A reader thread goes through the files in order and loads their bytes,
+// asking the kernel (posix_fadvise) to start reading the next
+// READ_AHEAD_FRAMES files in the background, so the disk works on several
+// files at a time. A pool of decoder threads decodes and prepares (resize,
+// ...) the loaded files, which may finish out of order, into a reorder
+// buffer that next() consumes in file order. At most READ_AHEAD_FRAMES
+// frames are loaded or decoded ahead of the consumer.
+//
+// JPEG files can be decoded at 1/2, 1/4 or 1/8 of their size directly in
+// the DCT domain (IMREAD_REDUCED_*), which skips most of the decode work
+// for large frames. Given a minimum size, each JPEG file is decoded with
+// the largest factor that keeps it at least that big, read from its SOF
+// header; the prepare function still does the final resize.
+
+#ifndef FRAME_READER_HPP
+#define FRAME_READER_HPP
+
+#include <opencv2/opencv.hpp>
+
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bounded_queue.hpp"
+
+int const DEFAULT_DECODER_THREADS = 2;
+size_t const READ_AHEAD_FRAMES = 16;
+
+// size of the JPEG image held in bytes, from its start of frame marker.
+// Returns false if it isn't a JPEG file
+inline bool jpegSize(const std::vector<uchar> &bytes, cv::Size &size)
+{
+    size_t n = bytes.size();
+    if(n < 4 || bytes[0] != 0xFF || bytes[1] != 0xD8)
+        return false;
+    size_t pos = 2;
+    while(pos + 4 <= n) {
+        if(bytes[pos] != 0xFF)
+            return false;
+        uchar marker = bytes[pos + 1];
+        if(marker == 0xFF) { // fill byte
+            pos++;
+            continue;
+        }
+        if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) { // no length
+            pos += 2;
+            continue;
+        }
+        size_t len = (bytes[pos + 2] << 8) | bytes[pos + 3];
+        // SOF0-SOF15, except DHT, JPG and DAC
+        if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            if(pos + 9 > n)
+                return false;
+            size.height = (bytes[pos + 5] << 8) | bytes[pos + 6];
+            size.width = (bytes[pos + 7] << 8) | bytes[pos + 8];
+            return size.width > 0 && size.height > 0;
+        }
+        if(marker == 0xDA || marker == 0xD9) // start of scan or end: no SOF
+            return false;
+        pos += 2 + len;
+    }
+    return false;
+}
+
+// imread flags (IMREAD_COLOR or IMREAD_GRAYSCALE) turned into the reduced
+// decode of an image of the given size that stays at least minSize
+inline int reducedReadFlags(int flags, cv::Size size, cv::Size minSize)
+{
+    bool gray = flags == cv::IMREAD_GRAYSCALE;
+    for(int factor = 8; factor > 1; factor /= 2) {
+        // libjpeg rounds the scaled size up
+        if((size.width + factor - 1) / factor < minSize.width
+           || (size.height + factor - 1) / factor < minSize.height)
+            continue;
+        if(factor == 8)
+            return gray ? cv::IMREAD_REDUCED_GRAYSCALE_8 : cv::IMREAD_REDUCED_COLOR_8;
+        if(factor == 4)
+            return gray ? cv::IMREAD_REDUCED_GRAYSCALE_4 : cv::IMREAD_REDUCED_COLOR_4;
+        return gray ? cv::IMREAD_REDUCED_GRAYSCALE_2 : cv::IMREAD_REDUCED_COLOR_2;
+    }
+    return flags;
+}
+
+class FrameReader {
+public:
+    // turns a decoded file into the frame to score and the one to write,
+    // which may share their data
+    typedef std::function<void(const cv::Mat &decoded, cv::Mat &frame, cv::Mat &out_frame)> PrepareFn;
+
+    // imreadFlags is IMREAD_COLOR or IMREAD_GRAYSCALE. With a non-empty
+    // minSize the JPEG files are decoded at a reduced size, see above
+    FrameReader(const std::vector<std::string> &paths, int imreadFlags, cv::Size minSize, PrepareFn prepare,
+                int n_decoders)
+        : paths(paths), imreadFlags(imreadFlags), minSize(minSize), prepare(prepare), files(READ_AHEAD_FRAMES),
+          next_index(0), stopping(false) {
+        reader = std::thread(&FrameReader::read_loop, this);
+        for(int i = 0; i < (n_decoders < 1 ? 1 : n_decoders); i++)
+            decoders.emplace_back(&FrameReader::decode_loop, this);
+    }
+
+    ~FrameReader() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        room.notify_all();
+        files.close();
+        reader.join();
+        for(size_t i = 0; i < decoders.size(); i++)
+            decoders[i].join();
+    }
+
+    // the next frame, in the order of the paths, waiting for it if needed.
+    // Returns false after the last one. The frames are empty if the file
+    // could not be read
+    bool next(cv::Mat &frame, cv::Mat &out_frame) {
+        if(next_index >= paths.size())
+            return false;
+        std::unique_lock<std::mutex> lock(mtx);
+        ready.wait(lock, [this] { return decoded.count(next_index) > 0; });
+        std::map<size_t, Decoded>::iterator it = decoded.find(next_index);
+        frame = it->second.frame;
+        out_frame = it->second.out_frame;
+        decoded.erase(it);
+        next_index++;
+        room.notify_all();
+        return true;
+    }
+
+private:
+    struct RawFile {
+        size_t index;
+        std::vector<uchar> bytes; // empty if the file could not be read
+    };
+
+    struct Decoded {
+        cv::Mat frame, out_frame;
+    };
+
+    static void advise(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0)
+            return;
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        ::close(fd);
+    }
+
+    static void load(const std::string &path, std::vector<uchar> &bytes) {
+        bytes.clear();
+        FILE *in = std::fopen(path.c_str(), "rb");
+        if(!in)
+            return;
+        if(std::fseek(in, 0, SEEK_END) == 0) {
+            long len = std::ftell(in);
+            if(len > 0 && std::fseek(in, 0, SEEK_SET) == 0) {
+                bytes.resize(len);
+                if(std::fread(bytes.data(), 1, len, in) != (size_t)len)
+                    bytes.clear();
+            }
+        }
+        std::fclose(in);
+    }
+
+    void read_loop() {
+        for(size_t i = 0; i < paths.size() && i < READ_AHEAD_FRAMES; i++)
+            advise(paths[i]);
+        for(size_t i = 0; i < paths.size(); i++) {
+            if(i + READ_AHEAD_FRAMES < paths.size())
+                advise(paths[i + READ_AHEAD_FRAMES]);
+            RawFile file;
+            file.index = i;
+            load(paths[i], file.bytes);
+            if(!files.push(std::move(file)))
+                return;
+        }
+        files.close();
+    }
+
+    void decode_loop() {
+        RawFile file;
+        while(files.pop(file)) {
+            Decoded out;
+            if(!file.bytes.empty()) {
+                int flags = imreadFlags;
+                cv::Size size;
+                if(minSize.area() > 0 && jpegSize(file.bytes, size))
+                    flags = reducedReadFlags(imreadFlags, size, minSize);
+                cv::Mat full_frame;
+                try {
+                    full_frame = cv::imdecode(file.bytes, flags);
+                } catch(cv::Exception &e) {
+                }
+                if(!full_frame.empty())
+                    prepare(full_frame, out.frame, out.out_frame);
+            }
+            std::unique_lock<std::mutex> lock(mtx);
+            // the decoder of the frame expected by next() never waits
+            // here, so the buffer can't get stuck
+            room.wait(lock, [&] { return stopping || file.index < next_index + READ_AHEAD_FRAMES; });
+            if(stopping)
+                return;
+            decoded[file.index] = out;
+            ready.notify_one();
+        }
+    }
+
+    std::vector<std::string> paths;
+    int imreadFlags;
+    cv::Size minSize;
+    PrepareFn prepare;
+    BoundedQueue<RawFile> files;
+    std::thread reader;
+    std::vector<std::thread> decoders;
+
+    std::mutex mtx;
+    std::condition_variable ready, room;
+    std::map<size_t, Decoded> decoded; // reorder buffer, by file index
+    size_t next_index;
+    bool stopping;
+};
+
+#endif
@@ -0,0 +1,215 @@
+// Writes the output frames on a pool of background threads, so encoding
+// (PNG deflate in particular) doesn't stall the processing during a burst
+// of foreground frames. The frames wait in a bounded queue: when the
+// writers can't keep up, write() blocks and the processing slows down
+// instead of buffering frames without limit.
+//
+// In link mode (copy()) the detected frames are not encoded at all: their
+// source file is hard linked into the output directory or, across file
+// systems, cloned (reflink), copied in the kernel (copy_file_range) or,
+// as a last resort, copied through a buffer.
+
+#ifndef FRAME_WRITER_HPP
+#define FRAME_WRITER_HPP
+
+#include <opencv2/opencv.hpp>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "bounded_queue.hpp"
+
+int const DEFAULT_WRITER_THREADS = 2;
+size_t const WRITER_QUEUE_SIZE = 32;
+
+// file extension and cv::imwrite parameters of the output frames
+struct OutputFormat {
+    std::string ext;
+    std::vector<int> params;
+};
+
+// name is one of png, jpg, ppm or bmp. quality is the PNG compression
+// level (0-9) or the JPEG quality (0-100), -1 for the OpenCV default; it
+// is ignored by the uncompressed formats. Returns false for an unknown
+// format name or a quality out of range
+inline bool parseOutputFormat(const std::string &name, int quality, OutputFormat &fmt)
+{
+    fmt.params.clear();
+    if(name == "png") {
+        fmt.ext = ".png";
+        if(quality < -1 || quality > 9)
+            return false;
+        if(quality >= 0)
+            fmt.params = {cv::IMWRITE_PNG_COMPRESSION, quality};
+    } else if(name == "jpg" || name == "jpeg") {
+        fmt.ext = ".jpg";
+        if(quality < -1 || quality > 100)
+            return false;
+        if(quality >= 0)
+            fmt.params = {cv::IMWRITE_JPEG_QUALITY, quality};
+    } else if(name == "ppm") {
+        fmt.ext = ".ppm";
+    } else if(name == "bmp") {
+        fmt.ext = ".bmp";
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// copies the size bytes of the file open as in into out, by reflink, in
+// kernel copy or through a buffer. Returns false on failure
+inline bool copyFileData(int in, int out, off_t size)
+{
+#ifdef FICLONE
+    if(::ioctl(out, FICLONE, in) == 0)
+        return true;
+#endif
+    off_t left = size;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    while(left > 0) {
+        ssize_t n = ::copy_file_range(in, NULL, out, NULL, left, 0);
+        if(n <= 0)
+            break;
+        left -= n;
+    }
+#endif
+    // copy_file_range not supported between these files: plain copy
+    if(left == size) {
+        char buf[1 << 16];
+        ssize_t n;
+        while(left > 0 && (n = ::read(in, buf, sizeof(buf))) > 0) {
+            if(::write(out, buf, n) != n)
+                break;
+            left -= n;
+        }
+    }
+    return left == 0;
+}
+
+// Puts the content of the file src at dst (replaced if it exists), by the
+// cheapest way available. Returns false on failure. Nothing is removed
+// before the new file is complete: it is made under a temporary name next
+// to dst and renamed over it, and if dst already is src (e.g. -o is the
+// input directory) it is left alone
+inline bool linkOrCopyFile(const std::string &src, const std::string &dst)
+{
+    struct stat src_st, dst_st;
+    if(::stat(src.c_str(), &src_st) != 0)
+        return false;
+    if(::stat(dst.c_str(), &dst_st) == 0 && dst_st.st_dev == src_st.st_dev && dst_st.st_ino == src_st.st_ino)
+        return true;
+
+    std::vector<char> tmp(dst.begin(), dst.end());
+    const char suffix[] = ".XXXXXX";
+    tmp.insert(tmp.end(), suffix, suffix + sizeof(suffix));
+    int fd = ::mkstemp(tmp.data());
+    if(fd < 0)
+        return false;
+    // the name is ours, link() needs it free
+    ::close(fd);
+    ::unlink(tmp.data());
+
+    bool ok = ::link(src.c_str(), tmp.data()) == 0;
+    if(!ok) {
+        int in = ::open(src.c_str(), O_RDONLY);
+        int out = ::open(tmp.data(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        ok = in >= 0 && out >= 0 && copyFileData(in, out, src_st.st_size);
+        if(in >= 0)
+            ::close(in);
+        if(out >= 0)
+            ok = ::close(out) == 0 && ok;
+    }
+    if(ok && ::rename(tmp.data(), dst.c_str()) == 0)
+        return true;
+    ::unlink(tmp.data());
+    return false;
+}
+
+class FrameWriter {
+public:
+    FrameWriter(const OutputFormat &fmt, int n_threads)
+        : fmt(fmt), jobs(WRITER_QUEUE_SIZE) {
+        for(int i = 0; i < (n_threads < 1 ? 1 : n_threads); i++)
+            writers.emplace_back(&FrameWriter::writer_loop, this);
+    }
+
+    ~FrameWriter() {
+        close();
+    }
+
+    const OutputFormat &format() const {
+        return fmt;
+    }
+
+    // queues frame to be written to path, blocking while the queue is
+    // full. The frame data is shared, not copied: it must not be modified
+    // afterwards
+    void write(const std::string &path, const cv::Mat &frame) {
+        WriteJob job;
+        job.path = path;
+        job.frame = frame;
+        jobs.push(std::move(job));
+    }
+
+    // queues the file src to be linked or copied to path (link mode)
+    void copy(const std::string &src, const std::string &path) {
+        WriteJob job;
+        job.path = path;
+        job.source = src;
+        jobs.push(std::move(job));
+    }
+
+    // waits until every queued frame is written
+    void close() {
+        jobs.close();
+        for(size_t i = 0; i < writers.size(); i++)
+            writers[i].join();
+        writers.clear();
+    }
+
+private:
+    struct WriteJob {
+        std::string path;
+        cv::Mat frame;
+        std::string source; // file to link or copy instead of frame
+    };
+
+    void writer_loop() {
+        WriteJob job;
+        while(jobs.pop(job)) {
+            bool ok;
+            if(!job.source.empty()) {
+                ok = linkOrCopyFile(job.source, job.path);
+            } else {
+                try {
+                    ok = cv::imwrite(job.path, job.frame, fmt.params);
+                } catch(cv::Exception &e) {
+                    ok = false;
+                }
+            }
+            if(!ok)
+                std::cerr << "ERROR, could not write '" << job.path << "'" << std::endl;
+            job.frame.release();
+        }
+    }
+
+    OutputFormat fmt;
+    BoundedQueue<WriteJob> jobs;
+    std::vector<std::thread> writers;
+};
+
+#endif
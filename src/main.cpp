@@ -4,13 +4,25 @@
 
 #include <experimental/filesystem>
 
+#include <glob.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <chrono>
+#include <climits>
+#include <fstream>
+#include <set>
 #include <string>
+#include <thread>
 
 #include "args.hxx"
 #include "SSIM.hpp"
 #include "eta.hpp"
+#include "reference_scorer.hpp"
+#include "frame_writer.hpp"
+#include "reference_cache.hpp"
+#include "bounded_queue.hpp"
+#include "alphanum.hpp"
+#include "raw_frame_source.hpp"
 
 using namespace std;
 using namespace cv;
@@ -21,7 +33,23 @@ int const RSZ_WIDTH = 640;
 int const RSZ_HEIGHT = 480;
 float DEFAULT_SIM_THRESH = 0.97;
 int DEFAULT_UPDATE_PROGRESS_RATE = 100;
-string OUT_EXT = ".png";
+string DEFAULT_OUT_FORMAT = "png";
+// frames buffered between two pipeline stages
+size_t const PIPELINE_QUEUE_SIZE = 16;
+
+// a frame travelling through the decode -> score -> write pipeline
+struct FrameJob {
+    long number;
+    double pos_msec;
+    Mat frame;
+    // frame to write and show when it isn't frame itself (--gray with
+    // --color-output)
+    Mat out_frame;
+    bool has_foreground;
+    int back_img_index;
+    float max_score;
+    bool reused;
+};
 
 bool read_resized(VideoCapture &cap, Mat &full_size, Mat &dest_img)
 {
@@ -31,6 +59,86 @@ bool read_resized(VideoCapture &cap, Mat &full_size, Mat &dest_img)
     return true;
 }
 
+// Extracts the luma of a frame decoded without conversion to BGR (see
+// --gray). Planar YUV frames come as a single channel with the chroma
+// planes below the Y plane, packed YUV 4:2:2 as two channels. If the
+// backend converted to BGR anyway, the luma is computed.
+void decoded_to_luma(const Mat &decoded, int height, Mat &luma)
+{
+    if(decoded.channels() == 3)
+        cv::cvtColor(decoded, luma, cv::COLOR_BGR2GRAY);
+    else if(decoded.channels() == 2)
+        cv::cvtColor(decoded, luma, cv::COLOR_YUV2GRAY_YUY2);
+    else if(height > 0 && decoded.rows > height)
+        luma = decoded.rowRange(0, height);
+    else
+        luma = decoded;
+}
+
+// read_resized() for --gray: only the luma is resized
+bool read_resized_luma(VideoCapture &cap, int height, Mat &full_size, Mat &dest_img)
+{
+    if(!cap.read(full_size))
+	return false;
+    Mat luma;
+    decoded_to_luma(full_size, height, luma);
+    cv::resize(luma, dest_img, cv::Size(RSZ_WIDTH, RSZ_HEIGHT), 0, 0, cv::INTER_AREA);
+    return true;
+}
+
+// skips the first frames with grab(), decoding all of them
+void skip_frames(VideoCapture &cap, long target, bool quiet)
+{
+    if(quiet) {
+        for(long i = 1; i < target; i++)
+            cap.grab();
+        return;
+    }
+    cout << "Skipping " << target - 1 << " frames..." << endl;
+    EtaEstimator eta(target);
+    cout << "frame " << 1;
+    for(long i = 1; i < target; i++) {
+        if((i % 300) == 0) {
+            // cout << string(120, ' ') << "\r" << flush;
+            cout << "frame " << i;
+            cout << " | ETA " << eta << "          " <<  "\r" << flush;
+        }
+        cap.grab();
+        eta.update();
+    }
+    cout << string(120, ' ') << "\r" << flush;
+}
+
+// Positions cap so that the next read() returns frame number target
+// (counted from 1, target > 1). The backend seeks to the keyframe before
+// the frame preceding target and decodes forward from there; that frame is
+// then grabbed and checked, by position and timestamp, to be the expected
+// one. If the container can't seek accurately (no index, variable frame
+// rate...) the video is reopened and the frames skipped one by one.
+// quiet turns off the messages and progress, for the shards.
+bool seek_to_frame(VideoCapture &cap, const string &path, long target, bool quiet = false)
+{
+    if(!quiet)
+        cout << "Seeking to frame " << target << "..." << endl;
+    double fps = cap.get(cv::CAP_PROP_FPS);
+    long before = target - 1; // frame grabbed to check the seek
+    if(fps > 0 && cap.set(cv::CAP_PROP_POS_FRAMES, before - 1) && cap.grab()) {
+        double expected_msec = (before - 1) * 1000.0 / fps;
+        double half_frame_msec = 500.0 / fps;
+        if(long(cap.get(cv::CAP_PROP_POS_FRAMES)) == before
+           && std::abs(cap.get(cv::CAP_PROP_POS_MSEC) - expected_msec) < half_frame_msec)
+            return true;
+    }
+
+    if(!quiet)
+        cout << "Seek is not accurate for this file" << endl;
+    cap.release();
+    if(!cap.open(path))
+        return false;
+    skip_frames(cap, target, quiet);
+    return true;
+}
+
 string millis_to_timestamp(long millis)
 {
     int seconds = (millis/1000) % 60;
@@ -44,16 +152,245 @@ string millis_to_timestamp(long millis)
     return copyOfStr;
 }
 
-float compareImages(Mat &imgA, Mat &imgB)
+// how the frames are decoded, see --gray and --color-output
+struct DecodeOptions {
+    bool gray;
+    bool color_output;
+    int frame_height;
+};
+
+// configures a freshly opened (and positioned) capture for dec
+void setup_capture(VideoCapture &cap, const DecodeOptions &dec)
+{
+    // without the conversion to BGR the decoder hands out the YUV planes,
+    // so the luma comes for free. Backends that don't support it keep
+    // converting and the luma is computed from BGR
+    if(dec.gray && !dec.color_output)
+        cap.set(cv::CAP_PROP_CONVERT_RGB, 0);
+}
+
+// reads the next frame into job: resized frame(s), number and time
+bool read_frame(VideoCapture &cap, const DecodeOptions &dec, Mat &full_frame, FrameJob &job)
+{
+    bool ok;
+    if(!dec.gray) {
+        ok = read_resized(cap, full_frame, job.frame);
+    } else if(dec.color_output) {
+        ok = read_resized(cap, full_frame, job.out_frame);
+        if(ok)
+            cv::cvtColor(job.out_frame, job.frame, cv::COLOR_BGR2GRAY);
+    } else {
+        ok = read_resized_luma(cap, dec.frame_height, full_frame, job.frame);
+    }
+    if(!ok)
+        return false;
+    job.number = cap.get(cv::CAP_PROP_POS_FRAMES);
+    job.pos_msec = cap.get(cv::CAP_PROP_POS_MSEC);
+    return true;
+}
+
+// reads the next frame of a raw stream (--raw) into job. number counts
+// the frames of the stream, fps gives their time (0 if unknown)
+bool read_raw_frame(RawFrameSource &source, const DecodeOptions &dec, double fps, long &number, FrameJob &job)
+{
+    Mat raw;
+    if(!source.read(raw))
+        return false;
+    if(dec.gray && dec.color_output && raw.channels() == 3) {
+        cv::resize(raw, job.out_frame, cv::Size(RSZ_WIDTH, RSZ_HEIGHT), 0, 0, cv::INTER_AREA);
+        cv::cvtColor(job.out_frame, job.frame, cv::COLOR_BGR2GRAY);
+    } else {
+        cv::resize(raw, job.frame, cv::Size(RSZ_WIDTH, RSZ_HEIGHT), 0, 0, cv::INTER_AREA);
+        if(dec.gray && job.frame.channels() == 3)
+            cv::cvtColor(job.frame, job.frame, cv::COLOR_BGR2GRAY);
+    }
+    job.number = ++number;
+    job.pos_msec = fps > 0 ? (number - 1) * 1000.0 / fps : 0.0;
+    return true;
+}
+
+// scores the frames of jobs, batched (see --batch) if there are several
+void score_jobs(ReferenceScorer &refScorer, vector<FrameJob> &jobs,
+                vector<Mat> &frames, vector<ScoreResult> &results)
+{
+    frames.resize(jobs.size());
+    for(size_t b = 0; b < jobs.size(); b++)
+        frames[b] = jobs[b].frame;
+    refScorer.scoreBatch(frames, results);
+    for(size_t b = 0; b < jobs.size(); b++) {
+        jobs[b].has_foreground = results[b].has_foreground;
+        jobs[b].back_img_index = results[b].back_img_index;
+        jobs[b].max_score = results[b].max_score;
+        jobs[b].reused = results[b].reused;
+    }
+}
+
+// name of the output file of a frame with foreground
+string output_name(const fs::path &inputPath, const FrameJob &job, const string &ext)
+{
+    std::ostringstream stringStream;
+    stringStream << inputPath.stem().string()
+                 << "_f" << job.number
+                 << "-t" << millis_to_timestamp(job.pos_msec)
+                 << "-ms" << fixed << setprecision(4) << job.max_score
+                 << ext
+                 << flush;
+    return stringStream.str();
+}
+
+// logs the frames with foreground and every visualRefreshRate-th frame.
+// The format is set on every line, so the log doesn't depend on what was
+// written before on out (see --shards)
+void log_frame(ostream &out, const FrameJob &job, int visualRefreshRate, const EtaEstimator &eta)
+{
+    if(job.has_foreground) {
+        out << "Object detected! | max_sim=" << fixed << setprecision(4) << job.max_score
+            << " | " << "frame " << job.number << " (" << millis_to_timestamp(job.pos_msec) << ")"
+            << (job.reused ? " | reused" : "")
+            << " | " << "ETA " << eta
+            << endl;
+    } else if((job.number % visualRefreshRate) == 0) {
+        out << "frame " << std::setfill('0') << std::setw(6) << job.number
+            << " (" << millis_to_timestamp(job.pos_msec) << ")"
+            << " | " << "max sim = " << fixed << setprecision(4) << job.max_score
+            << (job.reused ? " | reused" : "")
+            << " | " << "ETA " << eta
+            << endl;
+    }
+}
+
+// what the frames of a video are processed with, besides the frame range
+struct VideoSettings {
+    DecodeOptions decode;
+    std::shared_ptr<const ReferenceSet> refSet;
+    ScorerOptions scorer;
+    size_t batchSize;
+    int visualRefreshRate;
+    FrameWriter *writer;
+};
+
+struct RangeStats {
+    long frames = 0;
+    long detections = 0;
+};
+
+// Decodes and scores the frames first to last (inclusive, counted from 1;
+// last <= 0 for the whole video) of a video on the calling thread, with
+// its own capture and scorer. The log lines go to log and the frames
+// with foreground are queued for writing in outDir. Used by --shards and
+// by the processing of several videos.
+bool process_range(const fs::path &inputPath, long first, long last, const VideoSettings &settings,
+                   const fs::path &outDir, ostream &log, RangeStats &stats)
+{
+    VideoCapture cap(inputPath.string());
+    if(!cap.isOpened()) {
+        log << "ERROR! Unable to open file." << endl;
+        return false;
+    }
+    if(first > 1 && !seek_to_frame(cap, inputPath.string(), first, true)) {
+        log << "ERROR! Unable to reach frame " << first << "." << endl;
+        return false;
+    }
+    DecodeOptions dec = settings.decode;
+    dec.frame_height = cap.get(cv::CAP_PROP_FRAME_HEIGHT);
+    setup_capture(cap, dec);
+    if(last <= 0)
+        last = LONG_MAX;
+
+    ReferenceScorer scorer(settings.refSet, settings.scorer);
+    long frame_count = cap.get(cv::CAP_PROP_FRAME_COUNT);
+    EtaEstimator eta(std::min(last, frame_count > 0 ? frame_count : last) - first + 1);
+    Mat full_frame;
+    vector<FrameJob> jobs;
+    vector<Mat> frames;
+    vector<ScoreResult> results;
+    long number = first - 1;
+    bool more = true;
+    while(more) {
+        jobs.clear();
+        while(jobs.size() < settings.batchSize && number < last) {
+            FrameJob job;
+            if(!read_frame(cap, dec, full_frame, job)) {
+                more = false;
+                break;
+            }
+            number = job.number;
+            jobs.push_back(std::move(job));
+        }
+        if(number >= last)
+            more = false;
+        if(jobs.empty())
+            break;
+        score_jobs(scorer, jobs, frames, results);
+        for(size_t b = 0; b < jobs.size(); b++) {
+            log_frame(log, jobs[b], settings.visualRefreshRate, eta);
+            if(jobs[b].has_foreground) {
+                Mat &out = jobs[b].out_frame.empty() ? jobs[b].frame : jobs[b].out_frame;
+                string outName = output_name(inputPath, jobs[b], settings.writer->format().ext);
+                settings.writer->write((outDir / outName).string(), out);
+                stats.detections++;
+            }
+            stats.frames++;
+            eta.update();
+        }
+    }
+    return true;
+}
+
+// the videos given with -i: a directory (all its files), a glob pattern
+// or a single file. An existing file is never taken for a pattern, even
+// with *, ? or [ in its name
+vector<fs::path> list_videos(const string &input)
+{
+    vector<fs::path> videos;
+    if(fs::is_directory(input)) {
+        for(fs::directory_iterator it(input); it != fs::directory_iterator(); ++it)
+            if(fs::is_regular_file(it->path()))
+                videos.push_back(it->path());
+    } else if(!fs::exists(input) && input.find_first_of("*?[") != string::npos) {
+        glob_t matches;
+        if(glob(input.c_str(), 0, NULL, &matches) == 0)
+            for(size_t i = 0; i < matches.gl_pathc; i++)
+                videos.push_back(fs::path(matches.gl_pathv[i]));
+        globfree(&matches);
+    } else {
+        videos.push_back(fs::path(input));
+    }
+    sort(videos.begin(), videos.end(), [](const fs::path &a, const fs::path &b) {
+        return doj::alphanum_comp(a.string(), b.string()) < 0;
+    });
+    return videos;
+}
+
+// names of the output subdirectories of videos: their stem, with _2, _3...
+// added to the stems already taken, so videos of different directories
+// never share one
+vector<string> output_dir_names(const vector<fs::path> &videos)
 {
-    Mat scoreImage;
-    double maxScore;
-    cv::matchTemplate(imgA, imgB, scoreImage, TM_CCOEFF_NORMED);
-    minMaxLoc(scoreImage, 0, &maxScore);
-    return maxScore;
-    // VQMT::SSIM comparator = VQMT::SSIM(1280, 720);
-    // float ssim = comparator.compute(a, b);
-    // cout<< ssim << endl;
+    vector<string> names;
+    std::set<string> used;
+    for(size_t v = 0; v < videos.size(); v++) {
+        string stem = videos[v].stem().string();
+        string name = stem;
+        for(int k = 2; used.count(name); k++)
+            name = stem + "_" + std::to_string(k);
+        used.insert(name);
+        names.push_back(name);
+    }
+    return names;
+}
+
+// one video path per line, empty lines and lines starting with # skipped
+bool read_video_list(const fs::path &listPath, vector<fs::path> &videos)
+{
+    std::ifstream list(listPath.string());
+    if(!list)
+        return false;
+    string line;
+    while(std::getline(list, line))
+        if(!line.empty() && line[0] != '#')
+            videos.push_back(fs::path(line));
+    return true;
 }
 
 int main(int argc, char *argv[])
@@ -66,13 +403,43 @@ int main(int argc, char *argv[])
 				"that differs from some reference frames. The "
 				"difference is calculated with a configurable threshold.");
     args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
-    args::ValueFlag<std::string> pInputPath(parser, "videoOrDirecao", "The input video file OR directory", {'i'});
+    args::ValueFlag<std::string> pInputPath(parser, "videoOrDirecao", "The input video file, OR a directory or glob pattern of videos", {'i'});
     args::ValueFlag<std::string> pReferenceDirPath(parser, "directory", "The reference images dir path", {'r'});
     args::ValueFlag<std::string> pOutDirPath(parser, "directory", "The output directory path", {'o'});
     args::ValueFlag<int> pStartFrame(parser, "start_frame", "Ignores all frames before the specified one", {'s'});
     args::ValueFlag<int> pEndFrame(parser, "end_frame", "Ignores all frames after the specified one", {'e'});
     args::ValueFlag<float> pSimThresh(parser, "sim_thresh", "Similarity threshold", {'t'});
+    args::ValueFlag<std::string> pMetric(parser, "metric", "Similarity measure: ncc, ssim, sad or mse (default ncc)", {'m', "metric"});
+    args::ValueFlag<std::string> pMask(parser, "file", "Only score the pixels where this mask image is not black", {"mask"});
+    args::ValueFlag<std::string> pMaskDir(parser, "directory", "Masks of the references, by file name (any extension); the others use --mask", {"mask-dir"});
+    args::ValueFlag<int> pAdaptive(parser, "K", "Score against K background models seeded from the references and updated with the background frames, instead of all the references", {"adaptive"});
+    args::ValueFlag<float> pAdaptiveRate(parser, "rate", "Weight of a background frame in its --adaptive model (default 0.05)", {"adaptive-rate"});
     args::ValueFlag<int> pUpdateProgressRate(parser, "N", "Show progress every N frames", {'u'});
+    args::ValueFlag<int> pThreads(parser, "N", "Number of threads used to compare a frame with the references (default: all cores)", {'j', "threads"});
+    args::Flag pCascade(parser, "cascade", "Score the frames at 1/8 and 1/4 of the size first, only unclear ones at full size", {"cascade"});
+    args::ValueFlag<float> pCascadeMargin(parser, "margin", "How far from the similarity threshold a coarse score must be to decide (default 0.02)", {"cascade-margin"});
+    args::Flag pSkipStill(parser, "skip-still", "Reuse the last decision for frames that barely changed since the last scored one", {"skip-still"});
+    args::ValueFlag<float> pStillThresh(parser, "diff", "Mean difference (gray levels) of 32x24 thumbnails under which a frame is unchanged (default 1.5)", {"still-thresh"});
+    args::ValueFlag<int> pMaxReuse(parser, "N", "Frames in a row that may reuse a decision before a full scoring (default 30)", {"max-reuse"});
+    args::Flag pPHash(parser, "phash", "Only score the references with a perceptual hash close to the frame one", {"phash"});
+    args::ValueFlag<int> pPHashRadius(parser, "bits", "Max Hamming distance between the frame and reference hashes (default 12)", {"phash-radius"});
+    args::ValueFlag<int> pPHashCandidates(parser, "N", "Max number of references scored per frame with --phash (default 8)", {"phash-candidates"});
+    args::Flag pPHashFallback(parser, "phash-fallback", "Score all the references when --phash finds no candidate, instead of reporting foreground", {"phash-fallback"});
+    args::Flag pFixedOrder(parser, "fixed-order", "Always compare the references in file name order instead of trying the recent matches first", {"fixed-order"});
+    args::ValueFlag<int> pBatch(parser, "B", "Score B frames at a time with one matrix product (offline runs, not with --cascade or --phash)", {"batch"});
+    args::ValueFlag<std::string> pOutFormat(parser, "format", "Format of the output frames: png, jpg, ppm or bmp (default png)", {"out-format"});
+    args::ValueFlag<int> pOutQuality(parser, "level", "PNG compression level (0-9) or JPEG quality (0-100) of the output frames", {"out-quality"});
+    args::ValueFlag<int> pWriters(parser, "N", "Number of threads writing the output frames (default 2)", {"writers"});
+    args::ValueFlag<std::string> pVideoList(parser, "file", "Process the videos listed in file (one path per line) instead of -i", {"video-list"});
+    args::ValueFlag<int> pVideoJobs(parser, "N", "Number of videos processed at the same time when there are several (default: one per core, at most the number of videos)", {"video-jobs"});
+    args::ValueFlag<std::string> pRaw(parser, "WxH", "Read raw frames of this size from -i, a named pipe or - for stdin, instead of a video file", {"raw"});
+    args::ValueFlag<std::string> pRawFormat(parser, "format", "Pixel format of the --raw frames: gray8 or bgr24 (default bgr24)", {"raw-format"});
+    args::ValueFlag<double> pRawFps(parser, "fps", "Frame rate of the --raw frames, for the timestamps of the output files", {"raw-fps"});
+    args::ValueFlag<int> pShards(parser, "N", "Split the frame range in N segments processed in parallel, each with its own decoder", {"shards"});
+    args::Flag pGray(parser, "gray", "Decode, resize and score only the luma of the frames", {"gray"});
+    args::Flag pNoRefCache(parser, "no-ref-cache", "Don't read nor write the preprocessed references cache file next to the reference directory", {"no-ref-cache"});
+    args::Flag pVerifyNcc(parser, "verify-ncc", "Check the NCC scores against matchTemplate on the first 16 references of -r, then exit", {"verify-ncc"});
+    args::Flag pColorOutput(parser, "color-output", "With --gray, still write the detected frames in color", {"color-output"});
     args::Flag pVerbose(parser, "verbose", "Show image if found object only", {'v'});
     args::Flag pVerbose2(parser, "verbose", "Show EVERY image being processed", {"verbose2"});
     
@@ -91,13 +458,29 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    if(!pInputPath || !pReferenceDirPath || !pOutDirPath) {
+    if(pVerifyNcc && pReferenceDirPath) {
+        vector<string> paths;
+        for(fs::directory_iterator it(args::get(pReferenceDirPath)); it != fs::directory_iterator(); ++it)
+            paths.push_back(it->path().string());
+        sort(paths.begin(), paths.end());
+        ReferenceCache noCache("", cv::Size(RSZ_WIDTH, RSZ_HEIGHT), pGray ? IMREAD_GRAYSCALE : IMREAD_COLOR);
+        vector<Mat> images;
+        ReferenceStats stats;
+        noCache.load(paths, images, stats, ThreadPool::default_size());
+        double error = nccEngineError(images, VERIFY_NCC_REFS);
+        cout << "NCC engine vs matchTemplate on " << std::min<size_t>(images.size(), VERIFY_NCC_REFS)
+             << " references: max difference " << scientific << error
+             << (error < NCC_TOLERANCE ? " (ok)" : " (OVER THE TOLERANCE)") << endl;
+        return error < NCC_TOLERANCE ? 0 : 1;
+    }
+
+    if((!pInputPath && !pVideoList) || !pReferenceDirPath || !pOutDirPath) {
         std::cout << parser;
         return 1;
     }
 
     fs::path outPath = fs::path(args::get(pOutDirPath));
-    fs::path inputPath = fs::path(args::get(pInputPath));
+    fs::path inputPath = fs::path(pInputPath ? args::get(pInputPath) : "");
     fs::path refImagesDirPath = fs::path(args::get(pReferenceDirPath));
 
     long startFrame = 1;
@@ -117,12 +500,120 @@ int main(int argc, char *argv[])
     float simThresh = DEFAULT_SIM_THRESH;
     if(pSimThresh)
         simThresh = args::get(pSimThresh);
+
+    ScorerOptions scorerOpts;
+    scorerOpts.simThresh = simThresh;
+    scorerOpts.n_threads = ThreadPool::default_size();
+    if(pThreads)
+        scorerOpts.n_threads = args::get(pThreads);
+    if(pMetric && !parseMetric(args::get(pMetric), scorerOpts.metric))
+    {
+        std::cerr << "ERROR, unknown metric '" << args::get(pMetric) << "'" << endl;
+        return -1;
+    }
+    if(scorerOpts.metric != METRIC_NCC && pCascade)
+    {
+        std::cerr << "ERROR, --cascade only works with the ncc metric" << endl;
+        return -1;
+    }
+    if((pMask || pMaskDir) && (scorerOpts.metric == METRIC_SSIM || pCascade))
+    {
+        std::cerr << "ERROR, --mask and --mask-dir can't be used with the ssim metric or --cascade" << endl;
+        return -1;
+    }
+    scorerOpts.cascade = pCascade;
+    scorerOpts.adaptive_order = !pFixedOrder;
+    scorerOpts.skip_still = pSkipStill;
+    if(pStillThresh)
+        scorerOpts.still_thresh = args::get(pStillThresh);
+    if(pMaxReuse)
+        scorerOpts.max_reuse = args::get(pMaxReuse);
+    scorerOpts.phash_index = pPHash;
+    if(pPHashRadius)
+        scorerOpts.phash_radius = args::get(pPHashRadius);
+    if(pPHashCandidates)
+        scorerOpts.phash_candidates = args::get(pPHashCandidates);
+    scorerOpts.phash_fallback = pPHashFallback;
+    if(pAdaptive)
+    {
+        scorerOpts.adaptive_models = args::get(pAdaptive);
+        if(scorerOpts.adaptive_models < 1 || pPHash)
+        {
+            std::cerr << "ERROR, --adaptive needs at least 1 model and can't be used with --phash" << endl;
+            return -1;
+        }
+    }
+    if(pAdaptiveRate)
+        scorerOpts.adaptive_rate = args::get(pAdaptiveRate);
+    if(pCascadeMargin)
+        scorerOpts.cascade_margin = args::get(pCascadeMargin);
+
+    size_t batchSize = 1;
+    if(pBatch && args::get(pBatch) > 1)
+        batchSize = args::get(pBatch);
+    if(batchSize > 1 && (pCascade || pPHash))
+    {
+        std::cerr << "ERROR, --batch can't be used with --cascade or --phash" << endl;
+        return -1;
+    }
     
-    if(!fs::exists(inputPath))
+    cv::Size rawSize;
+    int rawType = CV_8UC3;
+    if(pRaw)
+    {
+        if(!parseRawSize(args::get(pRaw), rawSize))
+        {
+            std::cerr << "ERROR, --raw expects the frame size as WxH" << endl;
+            return -1;
+        }
+        if(pRawFormat && !parseRawFormat(args::get(pRawFormat), rawType))
+        {
+            std::cerr << "ERROR, unknown raw format '" << args::get(pRawFormat) << "'" << endl;
+            return -1;
+        }
+        if(rawType == CV_8UC1 && !pGray)
+        {
+            std::cerr << "ERROR, --raw-format gray8 needs --gray" << endl;
+            return -1;
+        }
+        if(pVideoList || (pShards && args::get(pShards) > 1))
+        {
+            std::cerr << "ERROR, --raw can't be used with --video-list or --shards" << endl;
+            return -1;
+        }
+    }
+
+    // several videos (directory, glob or list): processed in parallel, see
+    // below
+    vector<fs::path> videoPaths;
+    if(pRaw) {
+        videoPaths.push_back(inputPath);
+    } else if(pVideoList) {
+        if(!read_video_list(args::get(pVideoList), videoPaths))
+        {
+            std::cerr << "ERROR, could not read video list '" << args::get(pVideoList) << "'" << endl;
+            return -1;
+        }
+    } else {
+        videoPaths = list_videos(inputPath.string());
+    }
+    bool multiVideo = pVideoList || videoPaths.size() != 1 || videoPaths[0] != inputPath;
+    if(multiVideo && videoPaths.empty())
+    {
+        std::cerr << "ERROR, no video found in '" << inputPath.string() << "'" << endl;
+        return -1;
+    }
+    if(multiVideo && pShards && args::get(pShards) > 1)
+    {
+        std::cerr << "ERROR, --shards can't be used with several videos (a directory, a glob pattern or --video-list)" << endl;
+        return -1;
+    }
+
+    if(!multiVideo && inputPath != "-" && !fs::exists(inputPath))
     {
         std::cerr << "ERROR, input path '" << inputPath.string() << "' does not exist" << endl;
         return -1;
-    } else if(!fs::is_regular_file(inputPath) && !fs::is_symlink(inputPath))
+    } else if(!multiVideo && !pRaw && !fs::is_regular_file(inputPath) && !fs::is_symlink(inputPath))
     {
         std::cerr << "ERROR, path '" << inputPath.string() << "' is not a file" << endl;
         return -1;
@@ -144,6 +635,20 @@ int main(int argc, char *argv[])
     
     if(!fs::exists(outPath))
         fs::create_directories(outPath);
+
+    OutputFormat outFormat;
+    string outFormatName = DEFAULT_OUT_FORMAT;
+    if(pOutFormat)
+        outFormatName = args::get(pOutFormat);
+    if(!parseOutputFormat(outFormatName, pOutQuality ? args::get(pOutQuality) : -1, outFormat))
+    {
+        std::cerr << "ERROR, unknown output format '" << outFormatName << "' or --out-quality out of range" << endl;
+        return -1;
+    }
+    int nWriters = DEFAULT_WRITER_THREADS;
+    if(pWriters)
+        nWriters = args::get(pWriters);
+    FrameWriter frameWriter(outFormat, nWriters);
     
     // copy all paths to a vector and sort them
     cout << "Reading reference images and resizing..." << endl;
@@ -151,55 +656,205 @@ int main(int argc, char *argv[])
     pvec all_paths;
     copy(fs::directory_iterator(refImagesDirPath), fs::directory_iterator(), back_inserter(all_paths));
     sort(all_paths.begin(), all_paths.end());
-    fs::path fpath;
-    vector<Mat> refImages(all_paths.size());
-    for (int i = 0; i < all_paths.size(); i++) {
-        cout << "Reference Image " << i << " (" << all_paths[i].filename() << ")\r" << flush;
-        fpath = all_paths[i];
-        Mat full_size = cv::imread(fpath.string()); 
-        cv::resize(full_size, refImages[i], cv::Size(RSZ_WIDTH, RSZ_HEIGHT), 0, 0, cv::INTER_AREA);
-    }
-    cout << string(120, ' ') << '\r' << flush;
-    
-    VideoCapture cap;
-    cap.open(inputPath.string());
-    if(!cap.isOpened())
+    vector<string> refPaths;
+    for (int i = 0; i < all_paths.size(); i++)
+        refPaths.push_back(all_paths[i].string());
+    ReferenceCache refCache(pNoRefCache ? "" : referenceCachePath(refImagesDirPath.string(), pGray),
+                            cv::Size(RSZ_WIDTH, RSZ_HEIGHT), pGray ? IMREAD_GRAYSCALE : IMREAD_COLOR);
+    vector<Mat> refImages;
+    ReferenceStats refStats;
+    int nCached = refCache.load(refPaths, refImages, refStats, scorerOpts.n_threads);
+    if(nCached > 0)
+        cout << nCached << " of " << refImages.size() << " reference images read from the cache" << endl;
+    vector<Mat> refMasks;
+    string maskError;
+    if((pMask || pMaskDir)
+       && !loadReferenceMasks(refPaths, pMask ? args::get(pMask) : "", pMaskDir ? args::get(pMaskDir) : "",
+                              cv::Size(RSZ_WIDTH, RSZ_HEIGHT), refMasks, maskError))
     {
-        cerr << "ERROR! Unable to open file." << endl;
+        std::cerr << "ERROR, could not read mask '" << maskError << "' (or it is all black)" << endl;
         return -1;
     }
+    std::shared_ptr<const ReferenceSet> refSet = std::make_shared<const ReferenceSet>(
+        refImages, scorerOpts, &refStats, pMask || pMaskDir ? &refMasks : nullptr);
+    
+    if(multiVideo) {
+        // The references are preprocessed once and shared read-only by
+        // the videos, which are spread over a pool of workers. Each video
+        // is processed like a shard covering all of it, with its frames
+        // and log.txt in its own subdirectory of the output directory.
+        int nVideoJobs = std::min<int>(videoPaths.size(), ThreadPool::default_size());
+        if(pVideoJobs)
+            nVideoJobs = std::max(1, std::min<int>(videoPaths.size(), args::get(pVideoJobs)));
+        if(pVerbose || pVerbose2)
+            cout << "Frames are not shown when processing several videos" << endl;
+        cout << "Processing " << videoPaths.size() << " videos, " << nVideoJobs << " at a time." << endl;
 
-    long frame_count = cap.get(cv::CAP_PROP_FRAME_COUNT);
-    if(frame_count > 0) {
-        cout << "Frame count: " << frame_count << endl << endl;
+        VideoSettings settings;
+        settings.decode.gray = pGray;
+        settings.decode.color_output = pColorOutput;
+        settings.refSet = refSet;
+        settings.scorer = scorerOpts;
+        settings.scorer.n_threads = std::max(1, scorerOpts.n_threads / nVideoJobs);
+        settings.batchSize = batchSize;
+        settings.visualRefreshRate = visualRefreshRate;
+        settings.writer = &frameWriter;
+
+        vector<string> outDirNames = output_dir_names(videoPaths);
+        std::atomic<size_t> nextVideo(0);
+        std::mutex coutMutex;
+        vector<std::thread> workers;
+        for(int w = 0; w < nVideoJobs; w++) {
+            workers.emplace_back([&]() {
+                size_t v;
+                while((v = nextVideo.fetch_add(1)) < videoPaths.size()) {
+                    const fs::path &video = videoPaths[v];
+                    fs::path videoOutPath = outPath / outDirNames[v];
+                    std::error_code dirError;
+                    fs::create_directories(videoOutPath, dirError);
+                    std::ofstream log((videoOutPath / "log.txt").string());
+                    if(dirError || !log) {
+                        std::lock_guard<std::mutex> lock(coutMutex);
+                        cout << video.filename().string() << " | FAILED, could not create "
+                             << (videoOutPath / "log.txt").string() << endl;
+                        continue;
+                    }
+                    RangeStats stats;
+                    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                    bool ok = process_range(video, startFrame, pEndFrame ? endFrame : 0,
+                                            settings, videoOutPath, log, stats);
+                    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    std::lock_guard<std::mutex> lock(coutMutex);
+                    cout << video.filename().string() << " | ";
+                    if(!ok)
+                        cout << "FAILED, see " << (videoOutPath / "log.txt").string() << endl;
+                    else
+                        cout << stats.frames << " frames in " << fixed << setprecision(1) << seconds << " s"
+                             << " (" << (seconds > 0 ? stats.frames / seconds : 0.0) << " fps)"
+                             << " | " << stats.detections << " detections" << endl;
+                }
+            });
+        }
+        for(size_t w = 0; w < workers.size(); w++)
+            workers[w].join();
+        frameWriter.close();
+        return 0;
+    }
+
+    VideoCapture cap;
+    std::unique_ptr<RawFrameSource> rawSource;
+    DecodeOptions decodeOpts;
+    decodeOpts.gray = pGray;
+    decodeOpts.color_output = pColorOutput;
+    long frame_count = 0;
+    if(pRaw) {
+        rawSource.reset(new RawFrameSource(inputPath.string(), rawSize, rawType));
+        if(!rawSource->isOpen())
+        {
+            cerr << "ERROR! Unable to open " << inputPath.string() << "." << endl;
+            return -1;
+        }
+        decodeOpts.frame_height = rawSize.height;
+        cout << "Reading raw frames of " << rawSize.width << "x" << rawSize.height << "..." << endl << endl;
     } else {
-        cout << "Couldn't get frame count from metadata..." << endl;
+        cap.open(inputPath.string());
+        if(!cap.isOpened())
+        {
+            cerr << "ERROR! Unable to open file." << endl;
+            return -1;
+        }
+        decodeOpts.frame_height = cap.get(cv::CAP_PROP_FRAME_HEIGHT);
+
+        frame_count = cap.get(cv::CAP_PROP_FRAME_COUNT);
+        if(frame_count > 0) {
+            cout << "Frame count: " << frame_count << endl << endl;
+        } else {
+            cout << "Couldn't get frame count from metadata..." << endl;
+        }
     }
 
     if(!pEndFrame) {
-        endFrame = frame_count;
+        // a stream goes on until its end
+        endFrame = pRaw ? LONG_MAX : frame_count;
     } else {
         if(endFrame < startFrame)
             exit(0);
     }
 
+    int nShards = pShards ? args::get(pShards) : 1;
+    if(nShards > 1) {
+        if(endFrame <= 0)
+        {
+            cerr << "ERROR, --shards needs the frame count, give the last frame with -e" << endl;
+            return -1;
+        }
+        if(pSkipStill || pAdaptive)
+        {
+            cerr << "ERROR, --shards can't be used with --skip-still or --adaptive" << endl;
+            return -1;
+        }
+        if(pVerbose || pVerbose2)
+            cout << "Frames are not shown with --shards" << endl;
+        cap.release();
+
+        // Every shard has its own decoder and scorer (sharing the
+        // preprocessed references) and keeps its log lines, which are
+        // printed shard after shard so the log is in frame order.
+        // The shards start with a fresh scorer state: the options whose
+        // results depend on the frames before (--skip-still, --adaptive)
+        // are refused, and the references are scanned in index order, as
+        // with --fixed-order, since max_score depends on the scan order.
+        long total = endFrame - startFrame + 1;
+        // -s past the end of the video, as for endFrame < startFrame above
+        if(total <= 0)
+            return 0;
+        if(nShards > total)
+            nShards = total;
+        cout << "Started to process video in " << nShards << " shards." << endl;
+        VideoSettings settings;
+        settings.decode = decodeOpts;
+        settings.refSet = refSet;
+        settings.scorer = scorerOpts;
+        settings.scorer.n_threads = std::max(1, scorerOpts.n_threads / nShards);
+        settings.scorer.adaptive_order = false;
+        settings.batchSize = batchSize;
+        settings.visualRefreshRate = visualRefreshRate;
+        settings.writer = &frameWriter;
+        vector<std::ostringstream> shardLogs(nShards);
+        vector<std::thread> shards;
+        for(int k = 0; k < nShards; k++) {
+            long first = startFrame + total * k / nShards;
+            long last = startFrame + total * (k + 1) / nShards - 1;
+            shards.emplace_back([&, k, first, last]() {
+                RangeStats stats;
+                process_range(inputPath, first, last, settings, outPath, shardLogs[k], stats);
+            });
+        }
+        for(int k = 0; k < nShards; k++) {
+            shards[k].join();
+            cout << shardLogs[k].str() << flush;
+        }
+        frameWriter.close();
+        return 0;
+    }
+
+    // frames read from the raw stream
+    long rawNumber = 0;
     if(pStartFrame && startFrame > 1) {
-        cout << "Skipping " << startFrame - 1 << " frames..." << endl;
-        EtaEstimator eta(startFrame);
-        cout << "frame " << 1;
-        for(long i = 1; i < startFrame; i++) {
-            if((i % 300) == 0) {
-                // cout << string(120, ' ') << "\r" << flush;
-                cout << "frame " << i;
-                cout << " | ETA " << eta << "          " <<  "\r" << flush;
-            }
-            cap.grab();
-            eta.update();
+        bool reached = rawSource ? rawSource->skip(startFrame - 1) : seek_to_frame(cap, inputPath.string(), startFrame);
+        if(!reached)
+        {
+            cerr << "ERROR! Unable to reach frame " << startFrame << "." << endl;
+            return -1;
         }
-        cout << string(120, ' ') << "\r" << flush;
+        rawNumber = startFrame - 1;
     }
-    
-    Mat full_frame, cur_frame;
+
+    if(!rawSource)
+        setup_capture(cap, decodeOpts);
+    double rawFps = pRawFps ? args::get(pRawFps) : 0.0;
+    // the output files are named after the input, stdin has no name
+    fs::path namePath = inputPath == "-" ? fs::path("stdin") : inputPath;
 
     if(pVerbose || pVerbose2) {
         cv::namedWindow(CUR_FRAME_WINNAME, cv::WINDOW_NORMAL);
@@ -207,61 +862,78 @@ int main(int argc, char *argv[])
     }
 
     cout << "Started to process video." << endl;
-    read_resized(cap, full_frame, cur_frame);
-    if(pVerbose || pVerbose2)
-        cv::imshow(CUR_FRAME_WINNAME, cur_frame);
-    waitKey(100);
-    EtaEstimator eta(endFrame - startFrame + 1);
-    long cur_frame_number;
-    do {
-        bool has_foreground = true;
-        int back_img_index;
-        float diff_score, max_score = 0.0;
-        cur_frame_number = cap.get(cv::CAP_PROP_POS_FRAMES);
-        for(int i = 0; i < refImages.size(); i++) {
-            // the strategy is to compare the input frame with each
-            // background reference frame. If any of the background
-            // frames is nearly equal to the input frame, than there
-            // is no foreground.
-            // -------------
-            // this is necessary because the background varies along time
-            diff_score = compareImages(refImages[i], cur_frame);
-            if(diff_score >= max_score) {
-                max_score = diff_score;
-                back_img_index = i;
-            }
-            if(diff_score >= simThresh) {
-                has_foreground = false;
+
+    // The work is split in three stages connected by bounded queues:
+    //  - decoder: reads and resizes frames (own thread)
+    //  - scorer:  compares each frame with the reference images (own thread)
+    //  - writer:  logs and writes the frames with foreground (this thread,
+    //             since HighGUI calls must stay on the main thread)
+    // Each stage handles the frames in decoding order, so the output files
+    // and the log are the same as when everything ran in a single loop.
+    BoundedQueue<FrameJob> decodedFrames(PIPELINE_QUEUE_SIZE);
+    BoundedQueue<FrameJob> scoredFrames(PIPELINE_QUEUE_SIZE);
+
+    std::thread decoder([&]() {
+        Mat full_frame;
+        long cur_frame_number;
+        do {
+            FrameJob job;
+            bool ok = rawSource ? read_raw_frame(*rawSource, decodeOpts, rawFps, rawNumber, job)
+                                : read_frame(cap, decodeOpts, full_frame, job);
+            if(!ok)
+                break;
+            cur_frame_number = job.number;
+            if(!decodedFrames.push(std::move(job)))
                 break;
+        } while(cur_frame_number < endFrame);
+        decodedFrames.close();
+    });
+
+    ReferenceScorer refScorer(refSet, scorerOpts);
+    std::thread scorer([&]() {
+        // frames are scored batchSize at a time (1 unless --batch)
+        vector<FrameJob> jobs;
+        vector<Mat> frames;
+        vector<ScoreResult> results;
+        FrameJob job;
+        bool more = true;
+        while(more) {
+            jobs.clear();
+            while(jobs.size() < batchSize && (more = decodedFrames.pop(job)))
+                jobs.push_back(std::move(job));
+            if(jobs.empty())
+                break;
+            score_jobs(refScorer, jobs, frames, results);
+            for(size_t b = 0; b < jobs.size(); b++) {
+                if(!scoredFrames.push(std::move(jobs[b]))) {
+                    more = false;
+                    break;
+                }
             }
         }
+        scoredFrames.close();
+    });
 
-        if(has_foreground) {
+    // the length of a raw stream is only known with -e
+    EtaEstimator eta(endFrame == LONG_MAX ? 0 : endFrame - startFrame + 1);
+    FrameJob job;
+    bool first_frame = true;
+    while(scoredFrames.pop(job)) {
+        Mat &cur_frame = job.out_frame.empty() ? job.frame : job.out_frame;
+        if(first_frame) {
+            if(pVerbose || pVerbose2)
+                cv::imshow(CUR_FRAME_WINNAME, cur_frame);
+            waitKey(100);
+            first_frame = false;
+        }
+
+        log_frame(cout, job, visualRefreshRate, eta);
+        if(job.has_foreground) {
+            frameWriter.write((outPath / output_name(namePath, job, outFormat.ext)).string(), cur_frame);
             if(pVerbose || pVerbose2) {
                 cv::imshow(CUR_FRAME_WINNAME, cur_frame);
             }
-            string timestamp = millis_to_timestamp(cap.get(cv::CAP_PROP_POS_MSEC));
-            cout << "Object detected! | max_sim=" << fixed << setprecision(4) << max_score
-                 << " | " << "frame " << cur_frame_number << " (" << timestamp << ")"
-                 << " | " << "ETA " << eta
-                 << endl;
-            std::ostringstream stringStream;
-            stringStream << inputPath.stem().string()
-                         << "_f" << cur_frame_number
-                         << "-t" << timestamp
-                         << "-ms" << fixed << setprecision(4) << max_score
-                         << OUT_EXT
-                         << flush;
-            std::string outName = stringStream.str();
-            // cout << "Writing to " << outName << endl;
-            cv::imwrite((outPath / outName).string(), cur_frame);
-            // waitKey(100);
-        } else if((cur_frame_number % visualRefreshRate) == 0) {
-            cout << "frame " << std::setfill('0') << std::setw(6) << cur_frame_number
-                 << " (" << millis_to_timestamp(cap.get(cv::CAP_PROP_POS_MSEC)) << ")"
-                 << " | " << "max sim = " << max_score
-                 << " | " << "ETA " << eta
-                 << endl;
+        } else if((job.number % visualRefreshRate) == 0) {
             if(pVerbose || pVerbose2) {
                 cv::imshow(CUR_FRAME_WINNAME, cur_frame);
                 waitKey(100);
@@ -271,6 +943,9 @@ int main(int argc, char *argv[])
             waitKey(100);
         }
         eta.update();
-    } while((cur_frame_number < endFrame) && read_resized(cap, full_frame, cur_frame));
+    }
+    decoder.join();
+    scorer.join();
+    frameWriter.close();
     return 0;
 }
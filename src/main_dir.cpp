@@ -6,11 +6,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <climits>
+#include <memory>
 #include <string>
 
 #include "args.hxx"
 #include "SSIM.hpp"
 #include "eta.hpp"
+#include "reference_scorer.hpp"
+#include "frame_writer.hpp"
+#include "frame_reader.hpp"
+#include "raw_frame_source.hpp"
+#include "reference_cache.hpp"
 #include "alphanum.hpp"
 
 using namespace std;
@@ -45,18 +52,6 @@ string millis_to_timestamp(long millis)
     return copyOfStr;
 }
 
-float compareImages(Mat &imgA, Mat &imgB)
-{
-    Mat scoreImage;
-    double maxScore;
-    cv::matchTemplate(imgA, imgB, scoreImage, TM_CCOEFF_NORMED);
-    minMaxLoc(scoreImage, 0, &maxScore);
-    return maxScore;
-    // VQMT::SSIM comparator = VQMT::SSIM(1280, 720);
-    // float ssim = comparator.compute(a, b);
-    // cout<< ssim << endl;
-}
-
 int main(int argc, char *argv[])
 {
     // Mat a = cv::imread(argv[1], IMREAD_COLOR);
@@ -73,7 +68,35 @@ int main(int argc, char *argv[])
     args::ValueFlag<int> pStartFrame(parser, "start_frame", "Ignores all frames before the specified one", {'s'});
     args::ValueFlag<int> pEndFrame(parser, "end_frame", "Ignores all frames after the specified one", {'e'});
     args::ValueFlag<float> pSimThresh(parser, "sim_thresh", "Similarity threshold", {'t'});
+    args::ValueFlag<std::string> pMetric(parser, "metric", "Similarity measure: ncc, ssim, sad or mse (default ncc)", {'m', "metric"});
+    args::ValueFlag<std::string> pMask(parser, "file", "Only score the pixels where this mask image is not black", {"mask"});
+    args::ValueFlag<std::string> pMaskDir(parser, "directory", "Masks of the references, by file name (any extension); the others use --mask", {"mask-dir"});
+    args::ValueFlag<int> pAdaptive(parser, "K", "Score against K background models seeded from the references and updated with the background frames, instead of all the references", {"adaptive"});
+    args::ValueFlag<float> pAdaptiveRate(parser, "rate", "Weight of a background frame in its --adaptive model (default 0.05)", {"adaptive-rate"});
     args::ValueFlag<int> pUpdateProgressRate(parser, "N", "Show progress every N frames", {'u'});
+    args::ValueFlag<int> pThreads(parser, "N", "Number of threads used to compare a frame with the references (default: all cores)", {'j', "threads"});
+    args::Flag pCascade(parser, "cascade", "Score the frames at 1/8 and 1/4 of the size first, only unclear ones at full size", {"cascade"});
+    args::ValueFlag<float> pCascadeMargin(parser, "margin", "How far from the similarity threshold a coarse score must be to decide (default 0.02)", {"cascade-margin"});
+    args::Flag pSkipStill(parser, "skip-still", "Reuse the last decision for frames that barely changed since the last scored one", {"skip-still"});
+    args::ValueFlag<float> pStillThresh(parser, "diff", "Mean difference (gray levels) of 32x24 thumbnails under which a frame is unchanged (default 1.5)", {"still-thresh"});
+    args::ValueFlag<int> pMaxReuse(parser, "N", "Frames in a row that may reuse a decision before a full scoring (default 30)", {"max-reuse"});
+    args::Flag pPHash(parser, "phash", "Only score the references with a perceptual hash close to the frame one", {"phash"});
+    args::ValueFlag<int> pPHashRadius(parser, "bits", "Max Hamming distance between the frame and reference hashes (default 12)", {"phash-radius"});
+    args::ValueFlag<int> pPHashCandidates(parser, "N", "Max number of references scored per frame with --phash (default 8)", {"phash-candidates"});
+    args::Flag pPHashFallback(parser, "phash-fallback", "Score all the references when --phash finds no candidate, instead of reporting foreground", {"phash-fallback"});
+    args::Flag pFixedOrder(parser, "fixed-order", "Always compare the references in file name order instead of trying the recent matches first", {"fixed-order"});
+    args::ValueFlag<int> pBatch(parser, "B", "Score B frames at a time with one matrix product (offline runs, not with --cascade or --phash)", {"batch"});
+    args::ValueFlag<std::string> pOutFormat(parser, "format", "Format of the output frames: png, jpg, ppm or bmp (default: same as the input frames)", {"out-format"});
+    args::Flag pLinkOutput(parser, "link-output", "Hard link (or clone/copy) the original files of the detected frames into the output directory instead of writing the resized frames", {"link-output"});
+    args::ValueFlag<int> pOutQuality(parser, "level", "PNG compression level (0-9) or JPEG quality (0-100) of the output frames (with --out-format or --raw)", {"out-quality"});
+    args::ValueFlag<int> pWriters(parser, "N", "Number of threads writing the output frames (default 2)", {"writers"});
+    args::ValueFlag<std::string> pRaw(parser, "WxH", "Read raw frames of this size from -i, a named pipe or - for stdin, instead of a directory", {"raw"});
+    args::ValueFlag<std::string> pRawFormat(parser, "format", "Pixel format of the --raw frames: gray8 or bgr24 (default bgr24)", {"raw-format"});
+    args::Flag pFullDecode(parser, "full-decode", "Always decode the JPEG frames at full size, instead of the smallest DCT scaled size that is still at least 640x480", {"full-decode"});
+    args::ValueFlag<int> pDecoders(parser, "N", "Number of threads decoding the input frames ahead of the processing (default 2)", {"decoders"});
+    args::Flag pGray(parser, "gray", "Decode, resize and score only the luma of the frames", {"gray"});
+    args::Flag pNoRefCache(parser, "no-ref-cache", "Don't read nor write the preprocessed references cache file next to the reference directory", {"no-ref-cache"});
+    args::Flag pColorOutput(parser, "color-output", "With --gray, still write the detected frames in color", {"color-output"});
     args::Flag pVerbose(parser, "verbose", "Show image if found object only", {'v'});
     args::Flag pVerbose2(parser, "verbose", "Show EVERY image being processed", {"verbose2"});
     
@@ -118,12 +141,106 @@ int main(int argc, char *argv[])
     float simThresh = DEFAULT_SIM_THRESH;
     if(pSimThresh)
         simThresh = args::get(pSimThresh);
+
+    ScorerOptions scorerOpts;
+    scorerOpts.simThresh = simThresh;
+    scorerOpts.n_threads = ThreadPool::default_size();
+    if(pThreads)
+        scorerOpts.n_threads = args::get(pThreads);
+    if(pMetric && !parseMetric(args::get(pMetric), scorerOpts.metric))
+    {
+        std::cerr << "ERROR, unknown metric '" << args::get(pMetric) << "'" << endl;
+        return -1;
+    }
+    if(scorerOpts.metric != METRIC_NCC && pCascade)
+    {
+        std::cerr << "ERROR, --cascade only works with the ncc metric" << endl;
+        return -1;
+    }
+    if((pMask || pMaskDir) && (scorerOpts.metric == METRIC_SSIM || pCascade))
+    {
+        std::cerr << "ERROR, --mask and --mask-dir can't be used with the ssim metric or --cascade" << endl;
+        return -1;
+    }
+    scorerOpts.cascade = pCascade;
+    scorerOpts.adaptive_order = !pFixedOrder;
+    scorerOpts.skip_still = pSkipStill;
+    if(pStillThresh)
+        scorerOpts.still_thresh = args::get(pStillThresh);
+    if(pMaxReuse)
+        scorerOpts.max_reuse = args::get(pMaxReuse);
+    scorerOpts.phash_index = pPHash;
+    if(pPHashRadius)
+        scorerOpts.phash_radius = args::get(pPHashRadius);
+    if(pPHashCandidates)
+        scorerOpts.phash_candidates = args::get(pPHashCandidates);
+    scorerOpts.phash_fallback = pPHashFallback;
+    if(pAdaptive)
+    {
+        scorerOpts.adaptive_models = args::get(pAdaptive);
+        if(scorerOpts.adaptive_models < 1 || pPHash)
+        {
+            std::cerr << "ERROR, --adaptive needs at least 1 model and can't be used with --phash" << endl;
+            return -1;
+        }
+    }
+    if(pAdaptiveRate)
+        scorerOpts.adaptive_rate = args::get(pAdaptiveRate);
+    if(pCascadeMargin)
+        scorerOpts.cascade_margin = args::get(pCascadeMargin);
+
+    size_t batchSize = 1;
+    if(pBatch && args::get(pBatch) > 1)
+        batchSize = args::get(pBatch);
+    if(batchSize > 1 && (pCascade || pPHash))
+    {
+        std::cerr << "ERROR, --batch can't be used with --cascade or --phash" << endl;
+        return -1;
+    }
+    if(pLinkOutput && (pOutFormat || pOutQuality || pColorOutput))
+    {
+        std::cerr << "ERROR, --link-output keeps the original files, it can't be used with --out-format, --out-quality or --color-output" << endl;
+        return -1;
+    }
+    // without --out-format the frames keep the format of the input files,
+    // which the quality may not apply to
+    if(pOutQuality && !pOutFormat && !pRaw)
+    {
+        std::cerr << "ERROR, --out-quality needs --out-format" << endl;
+        return -1;
+    }
     
-    if(!fs::exists(inputPath))
+    cv::Size rawSize;
+    int rawType = CV_8UC3;
+    if(pRaw)
+    {
+        if(!parseRawSize(args::get(pRaw), rawSize))
+        {
+            std::cerr << "ERROR, --raw expects the frame size as WxH" << endl;
+            return -1;
+        }
+        if(pRawFormat && !parseRawFormat(args::get(pRawFormat), rawType))
+        {
+            std::cerr << "ERROR, unknown raw format '" << args::get(pRawFormat) << "'" << endl;
+            return -1;
+        }
+        if(rawType == CV_8UC1 && !pGray)
+        {
+            std::cerr << "ERROR, --raw-format gray8 needs --gray" << endl;
+            return -1;
+        }
+        if(pLinkOutput)
+        {
+            std::cerr << "ERROR, --link-output needs input files, it can't be used with --raw" << endl;
+            return -1;
+        }
+    }
+
+    if(inputPath != "-" && !fs::exists(inputPath))
     {
         std::cerr << "ERROR, input path '" << inputPath.string() << "' does not exist" << endl;
         return -1;
-    } else if(!fs::is_directory(inputPath))
+    } else if(!pRaw && !fs::is_directory(inputPath))
     {
         std::cerr << "ERROR, path '" << inputPath.string() << "' is not a directory" << endl;
         return -1;
@@ -145,6 +262,20 @@ int main(int argc, char *argv[])
     
     if(!fs::exists(outPath))
         fs::create_directories(outPath);
+
+    OutputFormat outFormat;
+    string outFormatName = "png";
+    if(pOutFormat)
+        outFormatName = args::get(pOutFormat);
+    if(!parseOutputFormat(outFormatName, pOutQuality ? args::get(pOutQuality) : -1, outFormat))
+    {
+        std::cerr << "ERROR, unknown output format '" << outFormatName << "' or --out-quality out of range" << endl;
+        return -1;
+    }
+    int nWriters = DEFAULT_WRITER_THREADS;
+    if(pWriters)
+        nWriters = args::get(pWriters);
+    FrameWriter frameWriter(outFormat, nWriters);
     
     // copy all paths to a vector and sort them
     cout << "Reading reference images and resizing..." << endl;
@@ -152,32 +283,63 @@ int main(int argc, char *argv[])
     pvec refimg_paths;
     copy(fs::directory_iterator(refImagesDirPath), fs::directory_iterator(), back_inserter(refimg_paths));
     sort(refimg_paths.begin(), refimg_paths.end());
-    fs::path fpath;
-    vector<Mat> refImages(refimg_paths.size());
-    for (int i = 0; i < refimg_paths.size(); i++) {
-        cout << "Reference Image " << i << " (" << refimg_paths[i].filename() << ")\r" << flush;
-        fpath = refimg_paths[i];
-        Mat full_size = cv::imread(fpath.string()); 
-        cv::resize(full_size, refImages[i], cv::Size(RSZ_WIDTH, RSZ_HEIGHT), 0, 0, cv::INTER_AREA);
+    vector<string> refPaths;
+    for (int i = 0; i < refimg_paths.size(); i++)
+        refPaths.push_back(refimg_paths[i].string());
+    ReferenceCache refCache(pNoRefCache ? "" : referenceCachePath(refImagesDirPath.string(), pGray),
+                            cv::Size(RSZ_WIDTH, RSZ_HEIGHT), pGray ? IMREAD_GRAYSCALE : IMREAD_COLOR);
+    vector<Mat> refImages;
+    ReferenceStats refStats;
+    int nCached = refCache.load(refPaths, refImages, refStats, scorerOpts.n_threads);
+    if(nCached > 0)
+        cout << nCached << " of " << refImages.size() << " reference images read from the cache" << endl;
+    vector<Mat> refMasks;
+    string maskError;
+    if((pMask || pMaskDir)
+       && !loadReferenceMasks(refPaths, pMask ? args::get(pMask) : "", pMaskDir ? args::get(pMaskDir) : "",
+                              cv::Size(RSZ_WIDTH, RSZ_HEIGHT), refMasks, maskError))
+    {
+        std::cerr << "ERROR, could not read mask '" << maskError << "' (or it is all black)" << endl;
+        return -1;
     }
-    cout << string(120, ' ') << '\r' << flush;
+    std::shared_ptr<const ReferenceSet> refSet = std::make_shared<const ReferenceSet>(
+        refImages, scorerOpts, &refStats, pMask || pMaskDir ? &refMasks : nullptr);
 
-    // obtain frames paths
-    cout << "Getting input frames paths..." << endl;
     pvec input_paths;
-    copy(fs::directory_iterator(inputPath), fs::directory_iterator(), back_inserter(input_paths));
-    sort(input_paths.begin(), input_paths.end(), doj::alphanum_less<std::string>());
-
-    long frame_count = input_paths.size();
-    if(frame_count > 0) {
-        cout << "Frame count: " << frame_count << endl << endl;
+    std::unique_ptr<RawFrameSource> rawSource;
+    if(pRaw) {
+        rawSource.reset(new RawFrameSource(inputPath.string(), rawSize, rawType));
+        if(!rawSource->isOpen())
+        {
+            std::cerr << "ERROR, could not open '" << inputPath.string() << "'" << endl;
+            return -1;
+        }
+        if(startFrame > 1 && !rawSource->skip(startFrame - 1))
+        {
+            std::cerr << "ERROR, the stream ends before frame " << startFrame << endl;
+            return -1;
+        }
+        cout << "Reading raw frames of " << rawSize.width << "x" << rawSize.height << "..." << endl << endl;
+        // a stream goes on until its end
+        if(!pEndFrame)
+            endFrame = LONG_MAX;
     } else {
-        cout << "No frames found!" << endl;
-        exit(1);
-    }
+        // obtain frames paths
+        cout << "Getting input frames paths..." << endl;
+        copy(fs::directory_iterator(inputPath), fs::directory_iterator(), back_inserter(input_paths));
+        sort(input_paths.begin(), input_paths.end(), doj::alphanum_less<std::string>());
 
-    if(!pEndFrame) {
-        endFrame = frame_count;
+        long frame_count = input_paths.size();
+        if(frame_count > 0) {
+            cout << "Frame count: " << frame_count << endl << endl;
+        } else {
+            cout << "No frames found!" << endl;
+            exit(1);
+        }
+
+        if(!pEndFrame) {
+            endFrame = frame_count;
+        }
     }
 
     if(pVerbose || pVerbose2) {
@@ -186,43 +348,91 @@ int main(int argc, char *argv[])
     }
 
     // --------------------------------------
-    Mat full_frame, cur_frame;
-    full_frame = imread(input_paths[startFrame - 1]);
-    cv::resize(full_frame, cur_frame, cv::Size(RSZ_WIDTH, RSZ_HEIGHT), 0, 0, cv::INTER_AREA);
+    Mat cur_frame;
+    // with --gray (and no color output) the decoder only produces the luma,
+    // JPEG files are not even converted to BGR
+    int readFlags = pGray && !pColorOutput ? IMREAD_GRAYSCALE : IMREAD_COLOR;
 
     cout << "Started to process files." << endl;
-    if(pVerbose || pVerbose2)
-        cv::imshow(CUR_FRAME_WINNAME, cur_frame);
-    waitKey(100);
-    EtaEstimator eta(endFrame - startFrame + 1);
+    ReferenceScorer refScorer(refSet, scorerOpts);
+    bool gray = pGray;
+    bool colorOutput = pGray && pColorOutput;
+    // resized frame to score and frame to write (shared unless
+    // colorOutput). Raw BGR frames are turned to gray here
+    auto prepare = [gray, colorOutput](const Mat &decoded, Mat &frame, Mat &out_frame) {
+        if(colorOutput && decoded.channels() == 3) {
+            cv::resize(decoded, out_frame, cv::Size(RSZ_WIDTH, RSZ_HEIGHT), 0, 0, cv::INTER_AREA);
+            cv::cvtColor(out_frame, frame, cv::COLOR_BGR2GRAY);
+        } else {
+            cv::resize(decoded, frame, cv::Size(RSZ_WIDTH, RSZ_HEIGHT), 0, 0, cv::INTER_AREA);
+            if(gray && frame.channels() == 3)
+                cv::cvtColor(frame, frame, cv::COLOR_BGR2GRAY);
+            out_frame = frame;
+        }
+    };
+    // the files are loaded and decoded ahead, in the background
+    std::unique_ptr<FrameReader> frameReader;
+    if(!rawSource) {
+        vector<string> framePaths;
+        for(long i = startFrame-1; i < endFrame; i++)
+            framePaths.push_back(input_paths[i].string());
+        frameReader.reset(new FrameReader(framePaths, readFlags,
+                                          pFullDecode ? cv::Size() : cv::Size(RSZ_WIDTH, RSZ_HEIGHT), prepare,
+                                          pDecoders ? args::get(pDecoders) : DEFAULT_DECODER_THREADS));
+    }
+    // the length of a raw stream is only known with -e
+    EtaEstimator eta(endFrame == LONG_MAX ? 0 : endFrame - startFrame + 1);
     long cur_frame_number;
+    // frames are read and scored batchSize at a time (1 unless --batch)
+    vector<Mat> batchFrames, batchOutFrames;
+    vector<ScoreResult> batchResults;
     for(long i = startFrame-1; i < endFrame; i++)
     {
-        full_frame = imread(input_paths[i]);
-        cv::resize(full_frame, cur_frame, cv::Size(RSZ_WIDTH, RSZ_HEIGHT), 0, 0, cv::INTER_AREA);
-
-        bool has_foreground = true;
-        int back_img_index;
-        float diff_score, max_score = 0.0;
-        cur_frame_number = i+1;
-        for(int i = 0; i < refImages.size(); i++) {
-            // the strategy is to compare the input frame with each
-            // background reference frame. If any of the background
-            // frames is nearly equal to the input frame, than there
-            // is no foreground.
-            // -------------
-            // this is necessary because the background varies along time
-            diff_score = compareImages(refImages[i], cur_frame);
-            if(diff_score >= max_score) {
-                max_score = diff_score;
-                back_img_index = i;
+        size_t batch_index = (i - (startFrame-1)) % batchSize;
+        if(batch_index == 0) {
+            batchFrames.resize(std::min<long>(batchSize, endFrame - i));
+            batchOutFrames.resize(batchFrames.size());
+            size_t n_read = 0;
+            for(size_t b = 0; b < batchFrames.size(); b++) {
+                // every frame comes in new buffers, the previous ones may
+                // still be queued for writing
+                if(rawSource) {
+                    Mat raw;
+                    if(!rawSource->read(raw))
+                        break;
+                    prepare(raw, batchFrames[b], batchOutFrames[b]);
+                } else {
+                    frameReader->next(batchFrames[b], batchOutFrames[b]);
+                    if(batchFrames[b].empty()) {
+                        std::cerr << "ERROR, could not read frame '" << input_paths[i + b].string() << "'" << endl;
+                        return -1;
+                    }
+                }
+                n_read++;
             }
-            if(diff_score >= simThresh) {
-                has_foreground = false;
+            // end of a raw stream
+            batchFrames.resize(n_read);
+            batchOutFrames.resize(n_read);
+            if(n_read == 0)
                 break;
-            }
+            refScorer.scoreBatch(batchFrames, batchResults);
+        }
+        if(batch_index >= batchFrames.size())
+            break;
+        cur_frame = batchOutFrames[batch_index];
+        if(i == startFrame-1) {
+            if(pVerbose || pVerbose2)
+                cv::imshow(CUR_FRAME_WINNAME, cur_frame);
+            waitKey(100);
         }
 
+        cur_frame_number = i+1;
+        ScoreResult res = batchResults[batch_index];
+        bool has_foreground = res.has_foreground;
+        int back_img_index = res.back_img_index;
+        float max_score = res.max_score;
+        bool reused = res.reused;
+
         if(has_foreground) {
             if(pVerbose || pVerbose2) {
                 cv::imshow(CUR_FRAME_WINNAME, cur_frame);
@@ -230,6 +440,7 @@ int main(int argc, char *argv[])
             // string timestamp = millis_to_timestamp(cap.get(cv::CAP_PROP_POS_MSEC));
             cout << "Object detected! | max_sim=" << fixed << setprecision(4) << max_score
                  << " | " << "frame " << cur_frame_number // << " (" << timestamp << ")"
+                 << (reused ? " | reused" : "")
                  << " | " << "ETA " << eta
                  << endl;
             // std::ostringstream stringStream;
@@ -242,13 +453,27 @@ int main(int argc, char *argv[])
             // std::string outName = stringStream.str();
             // cout << "Writing to " << outName << endl;
             // cv::imwrite((outPath / outName).string(), cur_frame);
-            fs::path full_out_path = outPath / input_paths[i].filename();
-            cv::imwrite(full_out_path.string(), cur_frame);
+            fs::path full_out_path;
+            if(rawSource) {
+                std::ostringstream rawName;
+                rawName << "frame_" << std::setfill('0') << std::setw(6) << cur_frame_number << outFormat.ext;
+                full_out_path = outPath / rawName.str();
+            } else {
+                full_out_path = outPath / input_paths[i].filename();
+            }
+            if(pLinkOutput) {
+                frameWriter.copy(input_paths[i].string(), full_out_path.string());
+            } else {
+                if(pOutFormat && !rawSource)
+                    full_out_path.replace_extension(outFormat.ext);
+                frameWriter.write(full_out_path.string(), cur_frame);
+            }
             // waitKey(100);
         } else if((cur_frame_number % visualRefreshRate) == 0) {
             cout << "frame " << std::setfill('0') << std::setw(6) << cur_frame_number
                  // << " (" << millis_to_timestamp(cap.get(cv::CAP_PROP_POS_MSEC)) << ")"
                  << " | " << "max sim = " << max_score
+                 << (reused ? " | reused" : "")
                  << " | " << "ETA " << eta
                  << endl;
             if(pVerbose || pVerbose2) {
@@ -261,5 +486,6 @@ int main(int argc, char *argv[])
         }
         eta.update();
     }
+    frameWriter.close();
     return 0;
 }
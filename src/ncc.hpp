@@ -0,0 +1,248 @@
+// Normalized cross-correlation (NCC) between images of the same size.
+//
+// For two images of the same size cv::matchTemplate(TM_CCOEFF_NORMED)
+// produces a single value:
+//
+//     sum((A - mean(A)) .* (B - mean(B))) / (||A - mean(A)|| * ||B - mean(B)||)
+//
+// with the means taken per channel and the norms over all channels. If
+// both images are stored already centered and divided by their norm, this
+// is a plain dot product. NccEngine keeps the references in that form
+// (computed once, when they are loaded) and each frame is normalized once,
+// so every frame/reference comparison costs a single vectorized dot
+// product instead of a full matchTemplate call.
+//
+// Precision: the engine works in float with double accumulation (like
+// matchTemplate), the scores differ from compareImages() by less than
+// NCC_TOLERANCE, which `videodiff --verify-ncc -r DIR` checks on the
+// references of DIR. Images with no variance (e.g. a black frame) score 0
+// against anything, as in matchTemplate.
+//
+// The comparisons of a scan are tiled: the dot product is summed
+// NCC_TILE_LEN values at a time and, after each tile, bounded by
+// Cauchy-Schwarz. With d the dot product of the tiles done so far and
+// |f|, |r| the norms of what is left of the frame and of the reference,
+//
+//     score <= d + |f| * |r|
+//
+// The norms left after each tile are computed once per reference and once
+// per frame. When the bound falls under the floor of the scan (the lower
+// of simThresh and the best score so far) by more than NCC_BOUND_EPS, the
+// reference can't be picked and the rest of its tiles are skipped.
+//
+// scoreBatch() scores several frames at once: with one normalized frame
+// per row of F and one reference per row of R, all the scores are the
+// matrix product F * R^T, computed with cv::gemm (cache blocked) over
+// slabs of references spread across a thread pool.
+//
+// Memory: each reference takes width * height * channels floats, 4 times
+// the 8-bit image (3.5 MB for 640x480 BGR).
+
+#ifndef NCC_HPP
+#define NCC_HPP
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+double const NCC_TOLERANCE = 1e-4;
+// values of a tile (32 KB, a few rows of a 640x480 frame), see above
+int const NCC_TILE_LEN = 8192;
+// margin of the bound for the float rounding of the normalized images
+double const NCC_BOUND_EPS = 1e-5;
+
+struct NccStats {
+    cv::Scalar mean; // per channel
+    double norm;     // L2 norm of the centered image, over all channels
+};
+
+// means and norm of img (8-bit, any number of channels)
+inline NccStats nccStats(const cv::Mat &img)
+{
+    CV_Assert(img.depth() == CV_8U);
+    NccStats stats;
+    cv::Scalar stddev;
+    cv::meanStdDev(img, stats.mean, stddev);
+
+    int cn = img.channels();
+    double sq_sum = 0.0;
+    for(int c = 0; c < cn; c++)
+        sq_sum += stddev[c] * stddev[c];
+    stats.norm = std::sqrt(sq_sum * img.total());
+    return stats;
+}
+
+// Writes img centered per channel and divided by its norm, as given by
+// stats, into dst as a single row of floats. dst is only reallocated when
+// its size changes.
+inline void nccApply(const cv::Mat &img, const NccStats &stats, cv::Mat &dst)
+{
+    int cn = img.channels();
+    dst.create(1, img.total() * cn, CV_32F);
+    float *out = dst.ptr<float>();
+    if(stats.norm <= 0.0) {
+        dst.setTo(cv::Scalar(0));
+        return;
+    }
+    float inv_norm = 1.0 / stats.norm;
+    float offset[4];
+    for(int c = 0; c < cn; c++)
+        offset[c] = stats.mean[c];
+
+    int row_len = img.cols * cn;
+    for(int y = 0; y < img.rows; y++) {
+        const uchar *in = img.ptr<uchar>(y);
+        if(cn == 1) {
+            for(int x = 0; x < row_len; x++)
+                out[x] = (in[x] - offset[0]) * inv_norm;
+        } else {
+            for(int x = 0; x < row_len; x += cn)
+                for(int c = 0; c < cn; c++)
+                    out[x + c] = (in[x + c] - offset[c]) * inv_norm;
+        }
+        out += row_len;
+    }
+}
+
+inline NccStats nccNormalize(const cv::Mat &img, cv::Mat &dst)
+{
+    NccStats stats = nccStats(img);
+    nccApply(img, stats, dst);
+    return stats;
+}
+
+// rest[k] = norm of the values of the normalized row img after its tile
+// k, for the bound of the tiled scoring
+inline void nccTileRest(const cv::Mat &img, float *rest)
+{
+    const float *data = img.ptr<float>();
+    int len = img.cols;
+    int n_tiles = (len + NCC_TILE_LEN - 1) / NCC_TILE_LEN;
+    double sq_sum = 0.0;
+    for(int k = n_tiles - 1; k >= 0; k--) {
+        rest[k] = std::sqrt(sq_sum);
+        for(int i = k * NCC_TILE_LEN; i < std::min(len, (k + 1) * NCC_TILE_LEN); i++)
+            sq_sum += double(data[i]) * data[i];
+    }
+}
+
+// a frame prepared by NccEngine::prepare() for the tiled scoring
+struct NccFrame {
+    cv::Mat normalized; // one row
+    std::vector<float> rest; // see nccTileRest()
+};
+
+// The metric engines (NccEngine, SsimEngine, SadEngine, MseEngine) share
+// this interface, which ReferenceScorer is templated on:
+//  - Frame: a frame prepared for the comparisons, by prepare();
+//  - Workspace: scratch buffers, one per scoring thread;
+//  - setReferences(), setReference() (replaces one), size();
+//  - score(frame, ref, workspace, floor): similarity, 1 for identical
+//    images. When the similarity is below floor the engine may stop early
+//    and return any value between it and floor.
+class NccEngine {
+public:
+    typedef NccFrame Frame;
+    struct Workspace {};
+
+    // normalizes the references, which must all have the same size and
+    // type as the frames that will be scored. known, if given, holds the
+    // stats of every reference (e.g. from the reference cache)
+    void setReferences(const std::vector<cv::Mat> &refImages, const std::vector<NccStats> *known = nullptr) {
+        stats.resize(refImages.size());
+        if(refImages.empty()) {
+            refData.release();
+            refRest.release();
+            return;
+        }
+        size_t len = refImages[0].total() * refImages[0].channels();
+        refData.create(refImages.size(), len, CV_32F);
+        refRest.create(refImages.size(), (len + NCC_TILE_LEN - 1) / NCC_TILE_LEN, CV_32F);
+        for(size_t i = 0; i < refImages.size(); i++) {
+            cv::Mat row = refData.row(i);
+            if(known) {
+                stats[i] = (*known)[i];
+                nccApply(refImages[i], stats[i], row);
+            } else {
+                stats[i] = nccNormalize(refImages[i], row);
+            }
+            nccTileRest(row, refRest.ptr<float>(i));
+        }
+    }
+
+    // replaces reference i by img, of the same size and type
+    void setReference(int i, const cv::Mat &img) {
+        cv::Mat row = refData.row(i);
+        stats[i] = nccNormalize(img, row);
+        nccTileRest(row, refRest.ptr<float>(i));
+    }
+
+    int size() const {
+        return stats.size();
+    }
+
+    // normalizes a frame, once per frame, as one row of scoreBatch()
+    NccStats prepare(const cv::Mat &frame, cv::Mat &normalized) const {
+        return nccNormalize(frame, normalized);
+    }
+
+    // same, with the norms left after each tile, for score()
+    void prepare(const cv::Mat &frame, NccFrame &out) const {
+        nccNormalize(frame, out.normalized);
+        out.rest.resize(refRest.cols);
+        nccTileRest(out.normalized, out.rest.data());
+    }
+
+    // NCC between a prepared frame and a reference, tiled, stopping when
+    // the bound shows it is under floor. It then returns the bound. Safe to
+    // call concurrently
+    float score(const NccFrame &frame, int ref, Workspace &, float floor) const {
+        int len = refData.cols;
+        const float *f = frame.normalized.ptr<float>();
+        const float *r = refData.ptr<float>(ref);
+        const float *r_rest = refRest.ptr<float>(ref);
+        double dot = 0.0;
+        for(int k = 0, start = 0; start < len; k++, start += NCC_TILE_LEN) {
+            int n = std::min(NCC_TILE_LEN, len - start);
+            dot += cv::Mat(1, n, CV_32F, const_cast<float *>(r + start))
+                       .dot(cv::Mat(1, n, CV_32F, const_cast<float *>(f + start)));
+            double bound = dot + double(frame.rest[k]) * r_rest[k];
+            if(bound < floor - NCC_BOUND_EPS)
+                return bound;
+        }
+        return dot;
+    }
+
+    // scores(b, i) = NCC between the prepared frame in row b of normFrames
+    // and reference i
+    void scoreBatch(const cv::Mat &normFrames, cv::Mat &scores, ThreadPool &pool) const {
+        int n_refs = size();
+        scores.create(normFrames.rows, n_refs, CV_32F);
+        std::atomic<int> next_slab(0);
+        pool.run([&](int) {
+            cv::Mat slabScores;
+            int first;
+            while((first = next_slab.fetch_add(BATCH_SLAB_REFS)) < n_refs) {
+                int last = std::min(first + BATCH_SLAB_REFS, n_refs);
+                cv::gemm(normFrames, refData.rowRange(first, last), 1.0, cv::Mat(), 0.0,
+                         slabScores, cv::GEMM_2_T);
+                cv::Mat dst = scores.colRange(first, last);
+                slabScores.copyTo(dst);
+            }
+        });
+    }
+
+private:
+    // references handled by one gemm call
+    static int const BATCH_SLAB_REFS = 16;
+
+    cv::Mat refData;
+    cv::Mat refRest; // nccTileRest() of each reference, one per row
+    std::vector<NccStats> stats;
+};
+
+#endif
@@ -0,0 +1,113 @@
+// Perceptual hash index over the reference images.
+//
+// Each image is summarized by a 64 bit difference hash (dHash): the image
+// is reduced to 9x8 gray pixels and every bit tells whether a pixel is
+// brighter than its right neighbour. Similar images have hashes at a small
+// Hamming distance. The hashes of the references are stored in a BK-tree
+// (a metric tree keyed on the Hamming distance), so the references close
+// to a frame are found without comparing the frame with all of them.
+
+#ifndef PHASH_INDEX_HPP
+#define PHASH_INDEX_HPP
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+inline uint64_t dHash(const cv::Mat &img)
+{
+    cv::Mat small, gray;
+    cv::resize(img, small, cv::Size(9, 8), 0, 0, cv::INTER_AREA);
+    if(small.channels() == 3)
+        cv::cvtColor(small, gray, cv::COLOR_BGR2GRAY);
+    else
+        gray = small;
+    uint64_t hash = 0;
+    for(int y = 0; y < 8; y++) {
+        const uchar *row = gray.ptr<uchar>(y);
+        for(int x = 0; x < 8; x++)
+            hash = (hash << 1) | (row[x] > row[x + 1] ? 1 : 0);
+    }
+    return hash;
+}
+
+inline int hammingDistance(uint64_t a, uint64_t b)
+{
+    return __builtin_popcountll(a ^ b);
+}
+
+class PHashIndex {
+public:
+    // hashes, if given, holds the dHash of every reference
+    void build(const std::vector<cv::Mat> &refImages, const std::vector<uint64_t> *hashes = nullptr) {
+        nodes.clear();
+        for(size_t i = 0; i < refImages.size(); i++)
+            insert(hashes ? (*hashes)[i] : dHash(refImages[i]), i);
+    }
+
+    // the (at most) max_candidates references whose hash is within radius
+    // of the one of frame, closest first
+    void query(const cv::Mat &frame, int radius, size_t max_candidates, std::vector<int> &candidates) const {
+        uint64_t hash = dHash(frame);
+        // (distance, reference) pairs
+        std::vector<std::pair<int, int> > found;
+        if(!nodes.empty())
+            search(0, hash, radius, found);
+        std::sort(found.begin(), found.end());
+        if(found.size() > max_candidates)
+            found.resize(max_candidates);
+        candidates.resize(found.size());
+        for(size_t i = 0; i < found.size(); i++)
+            candidates[i] = found[i].second;
+    }
+
+private:
+    struct Node {
+        uint64_t hash;
+        std::vector<int> refs; // references with exactly this hash
+        std::map<int, int> children; // distance to this node -> child node
+    };
+
+    void insert(uint64_t hash, int ref) {
+        if(nodes.empty()) {
+            nodes.push_back(Node{hash, {ref}, {}});
+            return;
+        }
+        int cur = 0;
+        while(true) {
+            int dist = hammingDistance(hash, nodes[cur].hash);
+            if(dist == 0) {
+                nodes[cur].refs.push_back(ref);
+                return;
+            }
+            std::map<int, int>::iterator child = nodes[cur].children.find(dist);
+            if(child == nodes[cur].children.end()) {
+                nodes[cur].children[dist] = nodes.size();
+                nodes.push_back(Node{hash, {ref}, {}});
+                return;
+            }
+            cur = child->second;
+        }
+    }
+
+    // by the triangle inequality only the children at a distance in
+    // [dist - radius, dist + radius] can hold hashes within radius
+    void search(int node, uint64_t hash, int radius, std::vector<std::pair<int, int> > &found) const {
+        int dist = hammingDistance(hash, nodes[node].hash);
+        if(dist <= radius)
+            for(size_t i = 0; i < nodes[node].refs.size(); i++)
+                found.push_back(std::make_pair(dist, nodes[node].refs[i]));
+        std::map<int, int>::const_iterator it = nodes[node].children.lower_bound(dist - radius);
+        std::map<int, int>::const_iterator end = nodes[node].children.upper_bound(dist + radius);
+        for(; it != end; ++it)
+            search(it->second, hash, radius, found);
+    }
+
+    std::vector<Node> nodes;
+};
+
+#endif
@@ -0,0 +1,130 @@
+// Input of raw video frames from stdin or a named pipe, e.g. from
+//
+//     ffmpeg -i in.mp4 -vf ... -f rawvideo -pix_fmt bgr24 -
+//
+// The frames are packed one after the other, with no header, at a size
+// and pixel format given on the command line (gray8 or bgr24). They are
+// read with large read() calls into a buffer of several frames that is
+// reused for the whole stream, and handed out without a copy.
+
+#ifndef RAW_FRAME_SOURCE_HPP
+#define RAW_FRAME_SOURCE_HPP
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// bytes asked to the kernel by each read() (rounded to whole frames)
+size_t const RAW_READ_BYTES = 8 << 20;
+// pipe buffer requested for stdin or the pipe, the Linux default of 64 KB
+// would split every frame in dozens of reads
+int const RAW_PIPE_SIZE = 1 << 20;
+
+// "WxH" -> size. Returns false if spec isn't a valid size
+inline bool parseRawSize(const std::string &spec, cv::Size &size)
+{
+    int w, h;
+    char end;
+    if(std::sscanf(spec.c_str(), "%dx%d%c", &w, &h, &end) != 2 || w <= 0 || h <= 0)
+        return false;
+    size = cv::Size(w, h);
+    return true;
+}
+
+// "gray8" or "bgr24" -> OpenCV type. Returns false for another format
+inline bool parseRawFormat(const std::string &name, int &type)
+{
+    if(name == "gray8")
+        type = CV_8UC1;
+    else if(name == "bgr24")
+        type = CV_8UC3;
+    else
+        return false;
+    return true;
+}
+
+class RawFrameSource {
+public:
+    // path "-" reads stdin
+    RawFrameSource(const std::string &path, cv::Size size, int type)
+        : size(size), type(type), frameBytes(size.area() * CV_ELEM_SIZE(type)), pos(0), filled(0) {
+        fd = path == "-" ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+#ifdef F_SETPIPE_SZ
+        if(fd >= 0)
+            ::fcntl(fd, F_SETPIPE_SZ, RAW_PIPE_SIZE);
+#endif
+        buffer.resize(std::max<size_t>(1, RAW_READ_BYTES / frameBytes) * frameBytes);
+    }
+
+    ~RawFrameSource() {
+        if(fd > STDIN_FILENO)
+            ::close(fd);
+    }
+
+    RawFrameSource(const RawFrameSource &) = delete;
+    RawFrameSource &operator=(const RawFrameSource &) = delete;
+
+    bool isOpen() const {
+        return fd >= 0;
+    }
+
+    // the next frame, pointing into the read buffer: it is only valid
+    // until the next call. Returns false at the end of the stream (a last
+    // incomplete frame is dropped) or on a read error
+    bool read(cv::Mat &frame) {
+        if(filled - pos < frameBytes && !refill())
+            return false;
+        frame = cv::Mat(size, type, buffer.data() + pos);
+        pos += frameBytes;
+        return true;
+    }
+
+    // drops the next n frames. Returns false if the stream ends before
+    bool skip(long n) {
+        cv::Mat frame;
+        for(long i = 0; i < n; i++)
+            if(!read(frame))
+                return false;
+        return true;
+    }
+
+private:
+    // moves what is left of the buffer to its start and reads until there
+    // is at least one whole frame, taking whatever more is available
+    bool refill() {
+        if(fd < 0)
+            return false;
+        size_t left = filled - pos;
+        if(left > 0)
+            std::memmove(buffer.data(), buffer.data() + pos, left);
+        pos = 0;
+        filled = left;
+        while(filled < frameBytes) {
+            ssize_t n = ::read(fd, buffer.data() + filled, buffer.size() - filled);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+                return false;
+            filled += n;
+        }
+        return true;
+    }
+
+    cv::Size size;
+    int type;
+    size_t frameBytes;
+    int fd;
+    std::vector<uchar> buffer;
+    size_t pos;    // start of the next frame in buffer
+    size_t filled; // bytes of buffer holding data
+};
+
+#endif
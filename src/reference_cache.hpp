@@ -0,0 +1,317 @@
+// Persistent cache of the preprocessed reference images.
+//
+// Decoding and resizing a large reference set takes minutes, so the
+// resized pixels are kept in a binary file next to the reference directory
+// along with their NCC stats and perceptual hash. Each entry is keyed on
+// the file name, size and modification time of its image; on later runs
+// the file is memory-mapped and only the references that were added or
+// changed are decoded again. The file is rewritten (to a temporary file
+// then renamed) when anything changed.
+//
+// Layout, in native byte order (the version field also detects a file
+// written on a machine with a different one):
+//
+//     CacheHeader
+//     CacheEntry[count]
+//     names (names_len bytes, not terminated)
+//     padding to CACHE_ALIGN
+//     pixels of the references, one after the other
+//
+// A file with another version, working size or pixel type is ignored and
+// replaced.
+
+#ifndef REFERENCE_CACHE_HPP
+#define REFERENCE_CACHE_HPP
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ncc.hpp"
+#include "phash_index.hpp"
+#include "reference_scorer.hpp"
+#include "thread_pool.hpp"
+
+uint32_t const CACHE_VERSION = 1;
+size_t const CACHE_ALIGN = 64;
+
+// the cache file of a reference directory: refs/ -> refs.refcache, with
+// a separate file for the gray references
+inline std::string referenceCachePath(std::string refDir, bool gray)
+{
+    while(refDir.size() > 1 && refDir[refDir.size() - 1] == '/')
+        refDir.erase(refDir.size() - 1);
+    return refDir + (gray ? ".gray.refcache" : ".refcache");
+}
+
+class ReferenceCache {
+public:
+    // cachePath empty disables the cache file: the references are then
+    // always decoded
+    ReferenceCache(const std::string &cachePath, cv::Size size, int imreadFlags)
+        : cachePath(cachePath), size(size), imreadFlags(imreadFlags),
+          type(imreadFlags == cv::IMREAD_GRAYSCALE ? CV_8UC1 : CV_8UC3) {
+    }
+
+    ~ReferenceCache() {
+        unmap();
+    }
+
+    ReferenceCache(const ReferenceCache &) = delete;
+    ReferenceCache &operator=(const ReferenceCache &) = delete;
+
+    // Fills images and stats with the references of paths, in that order,
+    // decoding the ones missing from the cache on n_threads threads. The
+    // images that can't be read are reported and left out, their paths
+    // are removed from paths. The images taken from the cache point into
+    // the mapped file, so this object must outlive them. Returns the
+    // number of references taken from the cache
+    int load(std::vector<std::string> &paths, std::vector<cv::Mat> &images, ReferenceStats &stats,
+             int n_threads) {
+        if(!cachePath.empty())
+            map();
+        images.assign(paths.size(), cv::Mat());
+        std::vector<CacheEntry> entries(paths.size());
+
+        int reused = 0;
+        std::vector<int> toDecode;
+        for(size_t i = 0; i < paths.size(); i++) {
+            CacheEntry &entry = entries[i];
+            std::memset(&entry, 0, sizeof(entry));
+            struct stat st;
+            if(::stat(paths[i].c_str(), &st) == 0) {
+                entry.file_size = st.st_size;
+                entry.mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+            }
+            std::map<std::string, int>::const_iterator cached = byName.find(fileName(paths[i]));
+            if(cached != byName.end() && mappedEntries[cached->second].file_size == entry.file_size
+               && mappedEntries[cached->second].mtime_ns == entry.mtime_ns) {
+                entry = mappedEntries[cached->second];
+                images[i] = cv::Mat(size, type, mappedPixels + cached->second * imageBytes());
+                reused++;
+            } else {
+                toDecode.push_back(i);
+            }
+        }
+
+        // the references are independent, each worker takes the next one
+        // to decode from a shared counter
+        std::atomic<size_t> next(0);
+        size_t done = 0; // guarded by outMutex
+        std::mutex outMutex;
+        ThreadPool pool(std::min<int>(n_threads, toDecode.size()));
+        pool.run([&](int) {
+            size_t k;
+            while((k = next.fetch_add(1)) < toDecode.size()) {
+                int i = toDecode[k];
+                cv::Mat full_size;
+                try {
+                    full_size = cv::imread(paths[i], imreadFlags);
+                } catch(cv::Exception &e) {
+                }
+                if(!full_size.empty()) {
+                    cv::resize(full_size, images[i], size, 0, 0, cv::INTER_AREA);
+                    NccStats ncc = nccStats(images[i]);
+                    for(int c = 0; c < 4; c++)
+                        entries[i].mean[c] = ncc.mean[c];
+                    entries[i].norm = ncc.norm;
+                    entries[i].hash = dHash(images[i]);
+                }
+                std::lock_guard<std::mutex> lock(outMutex);
+                done++;
+                if(full_size.empty())
+                    std::cerr << "WARNING, could not read reference image '" << paths[i] << "', skipped"
+                              << std::string(40, ' ') << std::endl;
+                else
+                    std::cout << "Reference Image " << done << " of " << toDecode.size() << " ("
+                              << fileName(paths[i]) << ")\r" << std::flush;
+            }
+        });
+        std::cout << std::string(120, ' ') << '\r' << std::flush;
+
+        // leave out the unreadable images
+        size_t kept = 0;
+        for(size_t i = 0; i < paths.size(); i++) {
+            if(images[i].empty())
+                continue;
+            paths[kept] = paths[i];
+            images[kept] = images[i];
+            entries[kept] = entries[i];
+            kept++;
+        }
+        paths.resize(kept);
+        images.resize(kept);
+        entries.resize(kept);
+
+        stats.ncc.resize(kept);
+        stats.hash.resize(kept);
+        for(size_t i = 0; i < kept; i++) {
+            for(int c = 0; c < 4; c++)
+                stats.ncc[i].mean[c] = entries[i].mean[c];
+            stats.ncc[i].norm = entries[i].norm;
+            stats.hash[i] = entries[i].hash;
+        }
+
+        bool changed = kept != (size_t)reused || (size_t)reused != byName.size();
+        if(changed && !cachePath.empty() && !save(paths, entries, images))
+            std::cerr << "WARNING, could not write the reference cache '" << cachePath << "'" << std::endl;
+        return reused;
+    }
+
+private:
+    struct CacheHeader {
+        char magic[8];
+        uint32_t version;
+        int32_t width;
+        int32_t height;
+        int32_t type;
+        uint32_t count;
+        uint32_t names_len;
+    };
+
+    struct CacheEntry {
+        uint64_t file_size;
+        int64_t mtime_ns;
+        double mean[4];
+        double norm;
+        uint64_t hash;
+        uint32_t name_offset;
+        uint32_t name_len;
+    };
+
+    static std::string fileName(const std::string &path) {
+        size_t slash = path.find_last_of('/');
+        return slash == std::string::npos ? path : path.substr(slash + 1);
+    }
+
+    static size_t pixelsOffset(uint32_t count, uint32_t names_len) {
+        size_t end = sizeof(CacheHeader) + count * sizeof(CacheEntry) + names_len;
+        return (end + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+    }
+
+    size_t imageBytes() const {
+        return size.area() * CV_ELEM_SIZE(type);
+    }
+
+    // maps the cache file if it is valid for the working size and type
+    void map() {
+        int fd = ::open(cachePath.c_str(), O_RDONLY);
+        if(fd < 0)
+            return;
+        struct stat st;
+        if(::fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(CacheHeader)) {
+            void *data = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(data != MAP_FAILED) {
+                mapped = data;
+                mappedSize = st.st_size;
+            }
+        }
+        ::close(fd);
+        if(!mapped)
+            return;
+
+        const CacheHeader *header = static_cast<const CacheHeader *>(mapped);
+        if(std::memcmp(header->magic, "VDREFC\0\0", 8) != 0 || header->version != CACHE_VERSION
+           || header->width != size.width || header->height != size.height || header->type != type
+           || pixelsOffset(header->count, header->names_len) + header->count * imageBytes() > mappedSize) {
+            unmap();
+            return;
+        }
+        mappedEntries = reinterpret_cast<const CacheEntry *>(header + 1);
+        const char *names = reinterpret_cast<const char *>(mappedEntries + header->count);
+        for(uint32_t i = 0; i < header->count; i++) {
+            const CacheEntry &entry = mappedEntries[i];
+            if(entry.name_offset + (uint64_t)entry.name_len > header->names_len) {
+                unmap();
+                return;
+            }
+            byName[std::string(names + entry.name_offset, entry.name_len)] = i;
+        }
+        // the images only read the mapping, the Mat constructor wants a
+        // non-const pointer
+        mappedPixels = const_cast<uchar *>(static_cast<const uchar *>(mapped))
+                       + pixelsOffset(header->count, header->names_len);
+    }
+
+    void unmap() {
+        if(mapped)
+            ::munmap(mapped, mappedSize);
+        mapped = nullptr;
+        mappedSize = 0;
+        mappedEntries = nullptr;
+        mappedPixels = nullptr;
+        byName.clear();
+    }
+
+    // writes a new cache file next to the old one, then renames it over
+    // the old one, which stays mapped until this object is destroyed
+    bool save(const std::vector<std::string> &paths, std::vector<CacheEntry> &entries,
+              const std::vector<cv::Mat> &images) {
+        std::string names;
+        for(size_t i = 0; i < paths.size(); i++) {
+            std::string name = fileName(paths[i]);
+            entries[i].name_offset = names.size();
+            entries[i].name_len = name.size();
+            names += name;
+        }
+        CacheHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, "VDREFC\0\0", 8);
+        header.version = CACHE_VERSION;
+        header.width = size.width;
+        header.height = size.height;
+        header.type = type;
+        header.count = entries.size();
+        header.names_len = names.size();
+
+        std::string tmpPath = cachePath + ".tmp";
+        FILE *out = std::fopen(tmpPath.c_str(), "wb");
+        if(!out)
+            return false;
+        bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1
+                  && (entries.empty() || std::fwrite(entries.data(), sizeof(CacheEntry), entries.size(), out) == entries.size())
+                  && std::fwrite(names.data(), 1, names.size(), out) == names.size();
+        size_t padding = pixelsOffset(header.count, header.names_len)
+                         - (sizeof(header) + entries.size() * sizeof(CacheEntry) + names.size());
+        std::vector<char> zeros(padding, 0);
+        ok = ok && std::fwrite(zeros.data(), 1, padding, out) == padding;
+        for(size_t i = 0; ok && i < images.size(); i++) {
+            const cv::Mat &img = images[i];
+            for(int y = 0; ok && y < img.rows; y++)
+                ok = std::fwrite(img.ptr<uchar>(y), CV_ELEM_SIZE(type), img.cols, out) == (size_t)img.cols;
+        }
+        ok = std::fclose(out) == 0 && ok;
+        if(ok)
+            ok = std::rename(tmpPath.c_str(), cachePath.c_str()) == 0;
+        if(!ok)
+            std::remove(tmpPath.c_str());
+        return ok;
+    }
+
+    std::string cachePath;
+    cv::Size size;
+    int imreadFlags;
+    int type;
+
+    void *mapped = nullptr;
+    size_t mappedSize = 0;
+    const CacheEntry *mappedEntries = nullptr;
+    uchar *mappedPixels = nullptr;
+    std::map<std::string, int> byName; // file name -> entry in the mapping
+};
+
+#endif
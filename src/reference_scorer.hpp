@@ -0,0 +1,683 @@
+// Comparison of an input frame against the set of reference (background)
+// images, shared by videodiff and framesdiff.
+
+#ifndef REFERENCE_SCORER_HPP
+#define REFERENCE_SCORER_HPP
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "diff_metrics.hpp"
+#include "ncc.hpp"
+#include "phash_index.hpp"
+#include "roi_mask.hpp"
+#include "ssim.hpp"
+#include "thread_pool.hpp"
+
+// Reference implementation of the similarity score, see NccEngine for the
+// one used to process the frames
+inline float compareImages(const cv::Mat &imgA, const cv::Mat &imgB)
+{
+    cv::Mat scoreImage;
+    double maxScore;
+    cv::matchTemplate(imgA, imgB, scoreImage, cv::TM_CCOEFF_NORMED);
+    cv::minMaxLoc(scoreImage, 0, &maxScore);
+    return maxScore;
+}
+
+// references compared with each other by --verify-ncc
+int const VERIFY_NCC_REFS = 16;
+
+// largest difference between the scores of NccEngine and compareImages()
+// over every pair of the first max_refs images (all of the same size and
+// type), which should stay under NCC_TOLERANCE
+inline double nccEngineError(const std::vector<cv::Mat> &images, int max_refs)
+{
+    std::vector<cv::Mat> refs(images.begin(), images.begin() + std::min<size_t>(max_refs, images.size()));
+    NccEngine engine;
+    engine.setReferences(refs);
+    NccEngine::Workspace work;
+    NccFrame frame;
+    double max_error = 0.0;
+    for(size_t f = 0; f < refs.size(); f++) {
+        engine.prepare(refs[f], frame);
+        for(size_t r = 0; r < refs.size(); r++) {
+            // a floor of -2 never stops the comparison early
+            double score = engine.score(frame, r, work, -2.0f);
+            max_error = std::max(max_error, std::abs(score - compareImages(refs[f], refs[r])));
+        }
+    }
+    return max_error;
+}
+
+// similarity measure between a frame and a reference
+enum Metric {
+    METRIC_NCC,  // normalized cross-correlation, see NccEngine
+    METRIC_SSIM, // structural similarity, see SsimEngine
+    METRIC_SAD,  // mean absolute difference, see SadEngine
+    METRIC_MSE   // root mean square difference, see MseEngine
+};
+
+// "ncc", "ssim", "sad" or "mse" -> metric. Returns false for an unknown
+// name
+inline bool parseMetric(const std::string &name, Metric &metric)
+{
+    if(name == "ncc")
+        metric = METRIC_NCC;
+    else if(name == "ssim")
+        metric = METRIC_SSIM;
+    else if(name == "sad")
+        metric = METRIC_SAD;
+    else if(name == "mse")
+        metric = METRIC_MSE;
+    else
+        return false;
+    return true;
+}
+
+float const DEFAULT_CASCADE_MARGIN = 0.02;
+// weight kept by the hit count of a reference from one frame to the next
+double const HIT_DECAY = 0.99;
+// references on each side of the last match that are tried right after it
+int const MATCH_NEIGHBOURS = 2;
+
+// mean absolute difference (gray levels) between the thumbnails of two
+// frames under which the second one is considered unchanged
+float const DEFAULT_STILL_THRESH = 1.5;
+// frames in a row that may reuse a decision before a full scoring
+int const DEFAULT_MAX_REUSE = 30;
+// Hamming distance of the reference hashes to the frame one, and number
+// of candidates kept, for the perceptual hash index
+int const DEFAULT_PHASH_RADIUS = 12;
+int const DEFAULT_PHASH_CANDIDATES = 8;
+// size of the thumbnails compared by the still frame check
+int const STILL_THUMB_WIDTH = 32;
+int const STILL_THUMB_HEIGHT = 24;
+// adaptive background models: weight of a background frame in the running
+// average of its model, how close to simThresh a match must be to take a
+// stale model, and after how many scored frames without a match a model
+// is stale
+float const DEFAULT_ADAPTIVE_RATE = 0.05;
+float const ADAPTIVE_REFRESH_MARGIN = 0.01;
+long const ADAPTIVE_STALE_FRAMES = 3000;
+
+struct ScoreResult {
+    bool has_foreground;
+    int back_img_index; // -1 if no reference scored above 0
+    float max_score;
+    bool reused; // decision copied from the last scored frame
+};
+
+struct ScorerOptions {
+    float simThresh;
+    int n_threads;
+    Metric metric = METRIC_NCC;
+    // coarse-to-fine cascade, see ReferenceScorer
+    bool cascade = false;
+    float cascade_margin = DEFAULT_CASCADE_MARGIN;
+    // scan the references in the order of the recent matches
+    bool adaptive_order = true;
+    // reuse the last decision for frames that barely changed
+    bool skip_still = false;
+    float still_thresh = DEFAULT_STILL_THRESH;
+    int max_reuse = DEFAULT_MAX_REUSE;
+    // only score the references whose perceptual hash is close to the
+    // frame one, see PHashIndex
+    bool phash_index = false;
+    int phash_radius = DEFAULT_PHASH_RADIUS;
+    int phash_candidates = DEFAULT_PHASH_CANDIDATES;
+    // scan all the references when the index gives no candidate, instead
+    // of reporting foreground
+    bool phash_fallback = false;
+    // score against this many background models updated online instead
+    // of all the references (0: off), see ReferenceScorer
+    int adaptive_models = 0;
+    float adaptive_rate = DEFAULT_ADAPTIVE_RATE;
+};
+
+// coarse-to-fine cascade levels, coarsest first, as divisors of the
+// working size
+int const N_CASCADE_LEVELS = 2;
+int const CASCADE_DIVISORS[N_CASCADE_LEVELS] = {8, 4};
+
+// statistics of the references computed ahead, see ReferenceCache
+struct ReferenceStats {
+    std::vector<NccStats> ncc;
+    std::vector<uint64_t> hash;
+};
+
+// The references preprocessed for ReferenceScorer: normalized for the NCC
+// at full size and, if needed, at every cascade level, and indexed by
+// perceptual hash. It is read-only once built, so the scorers of
+// several shards or videos can share one.
+//
+// With masks (one per reference, see roi_mask.hpp) only the pixels of the
+// mask of each reference are scored, by the masked engines. This works
+// with NCC, SAD and MSE, not with SSIM (whose windows need the whole
+// image) nor the cascade.
+//
+// With adaptive_models the set only keeps that many seeds, evenly spread
+// over the references (sorted by name, so over the day), and their masks:
+// every ReferenceScorer builds its own set of models from them.
+struct ReferenceSet {
+    // known, if given, holds the stats of every reference
+    ReferenceSet(const std::vector<cv::Mat> &refImages, const ScorerOptions &opts,
+                 const ReferenceStats *known = nullptr, const std::vector<cv::Mat> *masks = nullptr) {
+        metric = opts.metric;
+        masked = masks != nullptr;
+        adaptive = opts.adaptive_models > 0;
+        if(adaptive) {
+            n_refs = std::min<int>(opts.adaptive_models, refImages.size());
+            for(int j = 0; j < n_refs; j++) {
+                size_t i = (2 * j + 1) * refImages.size() / (2 * n_refs);
+                seeds.push_back(refImages[i]);
+                if(masked)
+                    seedMasks.push_back((*masks)[i]);
+            }
+            return;
+        }
+        n_refs = refImages.size();
+        if(masked) {
+            CV_Assert(metric != METRIC_SSIM && !opts.cascade);
+            // the known NCC stats are those of the whole images
+            if(metric == METRIC_SAD)
+                maskedSad.setReferences(refImages, *masks);
+            else if(metric == METRIC_MSE)
+                maskedMse.setReferences(refImages, *masks);
+            else
+                maskedNcc.setReferences(refImages, *masks);
+        } else if(metric == METRIC_SSIM)
+            ssim.setReferences(refImages);
+        else if(metric == METRIC_SAD)
+            sad.setReferences(refImages);
+        else if(metric == METRIC_MSE)
+            mse.setReferences(refImages);
+        else
+            ncc.setReferences(refImages, known ? &known->ncc : nullptr);
+        if(opts.phash_index)
+            phash.build(refImages, known ? &known->hash : nullptr);
+        if(opts.cascade && !refImages.empty()) {
+            std::vector<cv::Mat> small(refImages.size());
+            for(int l = 0; l < N_CASCADE_LEVELS; l++) {
+                int div = CASCADE_DIVISORS[l];
+                levelSize[l] = cv::Size(refImages[0].cols / div, refImages[0].rows / div);
+                for(size_t i = 0; i < refImages.size(); i++)
+                    cv::resize(refImages[i], small[i], levelSize[l], 0, 0, cv::INTER_AREA);
+                levelNcc[l].setReferences(small);
+            }
+        }
+    }
+
+    int size() const {
+        return n_refs;
+    }
+
+    // replaces reference i by img in the engine of the metric and the
+    // cascade levels. The hash index isn't updated
+    void update(int i, const cv::Mat &img) {
+        if(masked && metric == METRIC_SAD)
+            maskedSad.setReference(i, img);
+        else if(masked && metric == METRIC_MSE)
+            maskedMse.setReference(i, img);
+        else if(masked)
+            maskedNcc.setReference(i, img);
+        else if(metric == METRIC_SSIM)
+            ssim.setReference(i, img);
+        else if(metric == METRIC_SAD)
+            sad.setReference(i, img);
+        else if(metric == METRIC_MSE)
+            mse.setReference(i, img);
+        else
+            ncc.setReference(i, img);
+        for(int l = 0; l < N_CASCADE_LEVELS; l++) {
+            if(levelNcc[l].size() == 0)
+                break;
+            cv::resize(img, levelTmp, levelSize[l], 0, 0, cv::INTER_AREA);
+            levelNcc[l].setReference(i, levelTmp);
+        }
+    }
+
+    // only the engine of the metric holds the references
+    Metric metric;
+    int n_refs;
+    bool masked;
+    bool adaptive;
+    std::vector<cv::Mat> seeds, seedMasks; // adaptive only
+    NccEngine ncc;
+    SsimEngine ssim;
+    SadEngine sad;
+    MseEngine mse;
+    MaskedEngine<NccEngine> maskedNcc;
+    MaskedEngine<SadEngine> maskedSad;
+    MaskedEngine<MseEngine> maskedMse;
+    NccEngine levelNcc[N_CASCADE_LEVELS];
+    cv::Size levelSize[N_CASCADE_LEVELS];
+    PHashIndex phash;
+
+private:
+    cv::Mat levelTmp;
+};
+
+// per metric engine state of a ReferenceScorer: the prepared frame and a
+// workspace per pool thread
+template <typename Engine>
+struct MetricState {
+    typename Engine::Frame frame;
+    std::vector<typename Engine::Workspace> work;
+};
+
+// Scores a frame against every reference, spreading the references over
+// the threads of a pool.
+//
+// The strategy is to compare the input frame with each background
+// reference frame. If any of the background frames is nearly equal to the
+// input frame (score >= simThresh), then there is no foreground and the
+// remaining references don't need to be checked.
+//
+// The workers take the references in increasing index order from a shared
+// counter and publish the lowest index that reached simThresh, so the
+// others stop as soon as every reference before it has been scored. The
+// result is then reduced in index order exactly like the sequential loop
+// did, so max_score and back_img_index don't depend on the thread count.
+//
+// The background changes slowly, so the reference that matched the last
+// frame will probably match the next one. With adaptive_order the scan
+// starts with the last match, then its MATCH_NEIGHBOURS neighbours on each
+// side (the references are sorted by name, neighbours are usually close
+// in time), then the rest by decreasing recent hit count (decayed by
+// HIT_DECAY per frame). The foreground/background decision is the same as
+// in index order; for background frames max_score and back_img_index are
+// those of the references scanned until the match.
+//
+// With skip_still a thumbnail of each frame is compared with the one of
+// the last frame that was actually scored. If they differ by less than
+// still_thresh on average the frame gets the same result, flagged as
+// reused, without any reference comparison. After max_reuse frames in a
+// row the next frame is scored in full anyway. Comparing with the last
+// scored frame rather than the previous one keeps a slow drift from
+// going unnoticed.
+//
+// With phash_index the references are indexed by perceptual hash and each
+// frame is only scored against the (at most) phash_candidates references
+// within phash_radius of its hash, closest first. This scales to thousands
+// of references. If there is no candidate the frame is foreground, unless
+// phash_fallback asks for a scan of all the references.
+//
+// The score is the similarity given by the engine of opts.metric (NCC,
+// SSIM, SAD or MSE), 1 for identical images, so simThresh has the same
+// meaning with all of them. The references are preprocessed once in the
+// ReferenceSet and the frame once per call of score(). The cascade and the
+// batched matrix product are NCC only, and not used with masks.
+//
+// With adaptive_models the frames are scored against a few background
+// models instead of the references, for a constant cost per frame however
+// long the video and wherever the lighting goes. The models start as the
+// seeds of the ReferenceSet and are owned by the scorer. A frame matching
+// model i (background) is averaged into it with weight adaptive_rate,
+// unless the match is weak (under simThresh + ADAPTIVE_REFRESH_MARGIN,
+// the scene is drifting away from i) and some model hasn't matched for
+// ADAPTIVE_STALE_FRAMES scored frames: that stale model is then replaced
+// by the frame. Reused frames (skip_still) don't update the models.
+//
+// With the cascade enabled the frame is first scored on downscaled copies
+// (1/8 then 1/4 of the working size, i.e. 80x60 and 160x120 for 640x480).
+// A level decides when the answer is clear: some reference reaches
+// simThresh + cascade_margin (background) or all of them stay below
+// simThresh - cascade_margin (foreground), and max_score is then the score
+// at that level. Only the frames in between are scored at full size.
+class ReferenceScorer {
+public:
+    // refs must have been built with the same cascade and phash_index
+    // options
+    ReferenceScorer(std::shared_ptr<const ReferenceSet> refs, const ScorerOptions &opts)
+        : opts(opts), refs(refs), pool(opts.n_threads), scores(refs->size()),
+          order(refs->size()), hits(refs->size(), 0.0), last_match(-1),
+          byHits(refs->size()), placed(refs->size()), reuse_count(0), n_scored(0) {
+        if(refs->adaptive) {
+            ScorerOptions modelOpts = opts;
+            modelOpts.adaptive_models = 0;
+            models = std::make_shared<ReferenceSet>(refs->seeds, modelOpts, nullptr,
+                                                    refs->masked ? &refs->seedMasks : nullptr);
+            this->refs = models;
+            modelAcc.resize(models->size());
+            for(int i = 0; i < models->size(); i++)
+                refs->seeds[i].convertTo(modelAcc[i], CV_32F);
+            lastHit.assign(models->size(), 0);
+        }
+        std::iota(order.begin(), order.end(), 0);
+        nccState.work.resize(pool.size());
+        ssimState.work.resize(pool.size());
+        sadState.work.resize(pool.size());
+        mseState.work.resize(pool.size());
+        maskedNccState.work.resize(pool.size());
+        maskedSadState.work.resize(pool.size());
+        maskedMseState.work.resize(pool.size());
+        switch(opts.metric) {
+        case METRIC_SSIM:
+            scoreFrame = &ReferenceScorer::scoreSsim;
+            break;
+        case METRIC_SAD:
+            scoreFrame = refs->masked ? &ReferenceScorer::scoreMaskedSad : &ReferenceScorer::scoreSad;
+            break;
+        case METRIC_MSE:
+            scoreFrame = refs->masked ? &ReferenceScorer::scoreMaskedMse : &ReferenceScorer::scoreMse;
+            break;
+        default:
+            scoreFrame = refs->masked ? &ReferenceScorer::scoreMaskedNcc : &ReferenceScorer::scoreNcc;
+        }
+    }
+
+    // Scores several frames with one matrix product (see NccEngine), for
+    // offline runs where throughput matters more than latency. The results
+    // are the same as calling score() on each frame without the cascade
+    // and the hash index, which aren't used here. A batch of one frame goes through score().
+    void scoreBatch(const std::vector<cv::Mat> &frames, std::vector<ScoreResult> &results) {
+        int n_frames = frames.size();
+        results.resize(n_frames);
+        if(n_frames == 0)
+            return;
+        // the single matrix product only exists for NCC on whole frames
+        if(n_frames == 1 || opts.metric != METRIC_NCC || refs->masked || models) {
+            for(int b = 0; b < n_frames; b++)
+                results[b] = score(frames[b]);
+            return;
+        }
+        // source[b] = row of the scored frame whose result frame b gets,
+        // -1 for the last result of the previous call
+        toScore.clear();
+        source.resize(n_frames);
+        for(int b = 0; b < n_frames; b++) {
+            if(opts.skip_still && isStill(frames[b])) {
+                source[b] = toScore.size() - 1;
+            } else {
+                source[b] = toScore.size();
+                toScore.push_back(&frames[b]);
+            }
+        }
+        int n_scored = toScore.size();
+        if(n_scored > 0) {
+            batchFrames.create(n_scored, frames[0].total() * frames[0].channels(), CV_32F);
+            for(int b = 0; b < n_scored; b++) {
+                cv::Mat row = batchFrames.row(b);
+                refs->ncc.prepare(*toScore[b], row);
+            }
+            refs->ncc.scoreBatch(batchFrames, batchScores, pool);
+        }
+        for(int b = 0; b < n_frames; b++) {
+            bool scored_here = b == 0 ? source[b] == 0 : source[b] != source[b - 1];
+            if(scored_here) {
+                const float *row = batchScores.ptr<float>(source[b]);
+                for(size_t p = 0; p < order.size(); p++)
+                    scores[p] = row[order[p]];
+                reduce(order, opts.simThresh, lastResult);
+                updateOrder(lastResult);
+                results[b] = lastResult;
+            } else {
+                results[b] = lastResult;
+                results[b].reused = true;
+            }
+        }
+    }
+
+    ScoreResult score(const cv::Mat &frame) {
+        if(opts.skip_still && isStill(frame)) {
+            ScoreResult res = lastResult;
+            res.reused = true;
+            return res;
+        }
+        lastResult = (this->*scoreFrame)(frame);
+        updateOrder(lastResult);
+        if(models)
+            adapt(frame, lastResult);
+        return lastResult;
+    }
+
+private:
+    // the references to scan for frame, in that order
+    const std::vector<int> &scanOrder(const cv::Mat &frame) {
+        if(opts.phash_index) {
+            refs->phash.query(frame, opts.phash_radius, opts.phash_candidates, candidates);
+            if(!candidates.empty() || !opts.phash_fallback)
+                return candidates;
+        }
+        return order;
+    }
+
+    // The frame path of every metric, each one an instantiation of
+    // scanWith() with the comparison inlined in the scan loop. The
+    // constructor picks one for scoreFrame, so there is no dispatch per
+    // comparison
+    ScoreResult scoreNcc(const cv::Mat &frame) {
+        ScoreResult res;
+        const std::vector<int> &seq = scanOrder(frame);
+        // the levels only exist for a non-empty set
+        if(opts.cascade && refs->size() > 0) {
+            for(int l = 0; l < N_CASCADE_LEVELS; l++) {
+                cv::resize(frame, levelFrame[l], refs->levelSize[l], 0, 0, cv::INTER_AREA);
+                scanWith(refs->levelNcc[l], nccState, levelFrame[l], seq, opts.simThresh + opts.cascade_margin, res);
+                if(!res.has_foreground || res.max_score < opts.simThresh - opts.cascade_margin)
+                    return res;
+            }
+        }
+        scanWith(refs->ncc, nccState, frame, seq, opts.simThresh, res);
+        return res;
+    }
+
+    ScoreResult scoreSsim(const cv::Mat &frame) {
+        ScoreResult res;
+        scanWith(refs->ssim, ssimState, frame, scanOrder(frame), opts.simThresh, res);
+        return res;
+    }
+
+    ScoreResult scoreSad(const cv::Mat &frame) {
+        ScoreResult res;
+        scanWith(refs->sad, sadState, frame, scanOrder(frame), opts.simThresh, res);
+        return res;
+    }
+
+    ScoreResult scoreMse(const cv::Mat &frame) {
+        ScoreResult res;
+        scanWith(refs->mse, mseState, frame, scanOrder(frame), opts.simThresh, res);
+        return res;
+    }
+
+    ScoreResult scoreMaskedNcc(const cv::Mat &frame) {
+        ScoreResult res;
+        scanWith(refs->maskedNcc, maskedNccState, frame, scanOrder(frame), opts.simThresh, res);
+        return res;
+    }
+
+    ScoreResult scoreMaskedSad(const cv::Mat &frame) {
+        ScoreResult res;
+        scanWith(refs->maskedSad, maskedSadState, frame, scanOrder(frame), opts.simThresh, res);
+        return res;
+    }
+
+    ScoreResult scoreMaskedMse(const cv::Mat &frame) {
+        ScoreResult res;
+        scanWith(refs->maskedMse, maskedMseState, frame, scanOrder(frame), opts.simThresh, res);
+        return res;
+    }
+
+    template <typename Engine>
+    void scanWith(const Engine &engine, MetricState<Engine> &state, const cv::Mat &frame,
+                  const std::vector<int> &seq, float accept_thresh, ScoreResult &res) {
+        engine.prepare(frame, state.frame);
+        scan(seq, accept_thresh, res, [&](int thread, int ref, float floor) {
+            return engine.score(state.frame, ref, state.work[thread], floor);
+        });
+    }
+
+    // scores the prepared frame against the references listed in seq, in
+    // that order, until one reaches accept_thresh. score(thread, ref, floor)
+    // does one comparison, a template parameter so it is inlined in the
+    // loop. floor is the lower of accept_thresh and the best score so far:
+    // a reference scoring under both can't be chosen by reduce(), so the
+    // engine may stop as soon as it knows the score is under floor.
+    // scores[] is indexed by position in seq
+    template <typename ScoreFn>
+    void scan(const std::vector<int> &seq, float accept_thresh, ScoreResult &res, ScoreFn score) {
+        int n_refs = seq.size();
+        std::atomic<int> next_index(0);
+        std::atomic<int> first_hit(n_refs);
+        std::atomic<float> best(0.0f);
+
+        pool.run([&](int thread) {
+            int i;
+            while((i = next_index.fetch_add(1)) < first_hit.load()) {
+                float diff_score = score(thread, seq[i], std::min(accept_thresh, best.load()));
+                scores[i] = diff_score;
+                float cur_best = best.load();
+                while(diff_score > cur_best && !best.compare_exchange_weak(cur_best, diff_score))
+                    ;
+                if(diff_score >= accept_thresh) {
+                    int cur = first_hit.load();
+                    while(i < cur && !first_hit.compare_exchange_weak(cur, i))
+                        ;
+                }
+            }
+        });
+
+        reduce(seq, accept_thresh, res);
+    }
+
+    // the sequential loop over scores[], stopping at the first reference
+    // that reaches accept_thresh
+    void reduce(const std::vector<int> &seq, float accept_thresh, ScoreResult &res) const {
+        int n_refs = seq.size();
+        res.has_foreground = true;
+        res.reused = false;
+        res.back_img_index = -1;
+        res.max_score = 0.0;
+        for(int i = 0; i < n_refs; i++) {
+            if(scores[i] >= res.max_score) {
+                res.max_score = scores[i];
+                res.back_img_index = seq[i];
+            }
+            if(scores[i] >= accept_thresh) {
+                res.has_foreground = false;
+                break;
+            }
+        }
+    }
+
+    // true if frame can reuse the result of the last scored frame. If not,
+    // the frame will be scored and becomes the one the next frames are
+    // compared with
+    bool isStill(const cv::Mat &frame) {
+        cv::resize(frame, thumbTmp, cv::Size(STILL_THUMB_WIDTH, STILL_THUMB_HEIGHT), 0, 0, cv::INTER_AREA);
+        if(thumbTmp.channels() == 3)
+            cv::cvtColor(thumbTmp, thumb, cv::COLOR_BGR2GRAY);
+        else
+            thumbTmp.copyTo(thumb);
+        if(!lastThumb.empty() && reuse_count < opts.max_reuse) {
+            double diff = cv::norm(thumb, lastThumb, cv::NORM_L1) / thumb.total();
+            if(diff < opts.still_thresh) {
+                reuse_count++;
+                return true;
+            }
+        }
+        std::swap(thumb, lastThumb);
+        reuse_count = 0;
+        return false;
+    }
+
+    // updates the background models with a scored frame, see above
+    void adapt(const cv::Mat &frame, const ScoreResult &res) {
+        n_scored++;
+        if(res.has_foreground || res.back_img_index < 0)
+            return;
+        int i = res.back_img_index;
+        lastHit[i] = n_scored;
+        int stale = std::min_element(lastHit.begin(), lastHit.end()) - lastHit.begin();
+        if(res.max_score < opts.simThresh + ADAPTIVE_REFRESH_MARGIN
+           && n_scored - lastHit[stale] > ADAPTIVE_STALE_FRAMES) {
+            i = stale;
+            lastHit[i] = n_scored;
+            frame.convertTo(modelAcc[i], CV_32F);
+        } else {
+            cv::accumulateWeighted(frame, modelAcc[i], opts.adaptive_rate);
+        }
+        modelAcc[i].convertTo(modelImage, CV_8U);
+        models->update(i, modelImage);
+    }
+
+    // records the match of the last frame and rebuilds the scan order
+    void updateOrder(const ScoreResult &res) {
+        if(!opts.adaptive_order)
+            return;
+        for(size_t i = 0; i < hits.size(); i++)
+            hits[i] *= HIT_DECAY;
+        if(res.has_foreground || res.back_img_index < 0)
+            return;
+        last_match = res.back_img_index;
+        hits[last_match] += 1.0;
+
+        int n_refs = order.size();
+        std::iota(byHits.begin(), byHits.end(), 0);
+        std::stable_sort(byHits.begin(), byHits.end(), [this](int a, int b) {
+            return hits[a] > hits[b];
+        });
+        std::fill(placed.begin(), placed.end(), 0);
+        int p = 0;
+        auto place = [&](int i) {
+            if(i >= 0 && i < n_refs && !placed[i]) {
+                placed[i] = 1;
+                order[p++] = i;
+            }
+        };
+        place(last_match);
+        for(int d = 1; d <= MATCH_NEIGHBOURS; d++) {
+            place(last_match - d);
+            place(last_match + d);
+        }
+        for(int i = 0; i < n_refs; i++)
+            place(byHits[i]);
+    }
+
+    ScorerOptions opts;
+    std::shared_ptr<const ReferenceSet> refs;
+    cv::Mat levelFrame[N_CASCADE_LEVELS];
+    ScoreResult (ReferenceScorer::*scoreFrame)(const cv::Mat &frame);
+    MetricState<NccEngine> nccState;
+    MetricState<SsimEngine> ssimState;
+    MetricState<SadEngine> sadState;
+    MetricState<MseEngine> mseState;
+    MetricState<MaskedEngine<NccEngine> > maskedNccState;
+    MetricState<MaskedEngine<SadEngine> > maskedSadState;
+    MetricState<MaskedEngine<MseEngine> > maskedMseState;
+    cv::Mat batchFrames, batchScores;
+    ThreadPool pool;
+    std::vector<float> scores;
+    // order[p] = reference scanned at position p
+    std::vector<int> order;
+    std::vector<double> hits;
+    int last_match;
+    // buffers of updateOrder()
+    std::vector<int> byHits;
+    std::vector<char> placed;
+    std::vector<int> candidates;
+    // still frame check
+    cv::Mat thumbTmp, thumb, lastThumb;
+    int reuse_count;
+    ScoreResult lastResult;
+    // buffers of scoreBatch()
+    std::vector<const cv::Mat *> toScore;
+    std::vector<int> source;
+    // adaptive background models: refs points to models, modelAcc[i] is
+    // the running average of model i and lastHit[i] the value of n_scored
+    // at its last match
+    std::shared_ptr<ReferenceSet> models;
+    std::vector<cv::Mat> modelAcc;
+    cv::Mat modelImage;
+    std::vector<long> lastHit;
+    long n_scored;
+};
+
+#endif
@@ -0,0 +1,265 @@
+// Region of interest masks: the part of the frames that is scored, to
+// leave out timestamps, sky, moving foliage...
+//
+// A mask is an image of the size of the frames (resized to the working
+// size if needed, nearest neighbour), non-zero where the pixels count. It
+// is either one mask for all the references (--mask) or one per reference
+// (--mask-dir, the file with the same name as the reference, whatever its
+// extension); references without their own mask use the global one, or
+// the whole frame.
+//
+// RoiMask keeps a mask as the runs of consecutive valid pixels of each
+// row, and pack() copies them one after the other into a single row, so
+// the valid pixels of an image end up contiguous. MaskedEngine packs the
+// references once, when they are loaded, and runs the metric engine on the
+// packed images: scoring costs in proportion to the size of the region. A
+// frame is packed and prepared for a mask when the first reference with
+// that mask is scored, so a scan stopping early (match, adaptive order)
+// doesn't pay for the masks of the references it didn't reach. The masks
+// are told apart by a hash of their pixels.
+
+#ifndef ROI_MASK_HPP
+#define ROI_MASK_HPP
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <dirent.h>
+
+class RoiMask {
+public:
+    // mask: 8-bit, one channel, 0 or 255
+    explicit RoiMask(const cv::Mat &mask) : mask(mask), n_valid(0) {
+        for(int y = 0; y < mask.rows; y++) {
+            const uchar *m = mask.ptr<uchar>(y);
+            int x = 0;
+            while(x < mask.cols) {
+                if(!m[x]) {
+                    x++;
+                    continue;
+                }
+                Run run = {y, x, 0};
+                while(x < mask.cols && m[x])
+                    x++;
+                run.len = x - run.x;
+                runs.push_back(run);
+                n_valid += run.len;
+            }
+        }
+    }
+
+    bool same(const cv::Mat &other) const {
+        return other.size() == mask.size() && cv::countNonZero(other != mask) == 0;
+    }
+
+    // FNV-1a hash of the pixels of a mask
+    static uint64_t hash(const cv::Mat &mask) {
+        uint64_t h = 14695981039346656037ULL;
+        for(int y = 0; y < mask.rows; y++) {
+            const uchar *m = mask.ptr<uchar>(y);
+            for(int x = 0; x < mask.cols; x++)
+                h = (h ^ m[x]) * 1099511628211ULL;
+        }
+        return h;
+    }
+
+    // number of valid pixels
+    size_t count() const {
+        return n_valid;
+    }
+
+    // the valid pixels of img (same size as the mask, any type), in row
+    // order, into a single row dst. dst is only reallocated when its size
+    // changes
+    void pack(const cv::Mat &img, cv::Mat &dst) const {
+        CV_Assert(img.size() == mask.size());
+        dst.create(1, n_valid, img.type());
+        size_t esz = img.elemSize();
+        uchar *out = dst.data;
+        for(size_t i = 0; i < runs.size(); i++) {
+            std::memcpy(out, img.ptr(runs[i].y) + runs[i].x * esz, runs[i].len * esz);
+            out += runs[i].len * esz;
+        }
+    }
+
+private:
+    struct Run {
+        int y, x, len;
+    };
+
+    cv::Mat mask;
+    std::vector<Run> runs;
+    size_t n_valid;
+};
+
+// a metric engine (see NccEngine) scoring only the pixels of the mask of
+// each reference. The references sharing a mask are packed together in
+// an Engine of their own
+template <typename Engine>
+class MaskedEngine {
+public:
+    // a frame, packed and prepared for each mask on demand by score()
+    struct Frame {
+        cv::Mat source;
+        size_t n_regions = 0;
+        mutable std::vector<cv::Mat> packed;               // per mask
+        mutable std::vector<typename Engine::Frame> parts; // packed[r] prepared
+        mutable std::unique_ptr<std::atomic<bool>[]> ready; // parts[r] is done
+        mutable std::unique_ptr<std::mutex[]> locks;
+    };
+    typedef typename Engine::Workspace Workspace;
+
+    // masks[i] is the mask of reference i, see loadReferenceMasks()
+    void setReferences(const std::vector<cv::Mat> &refImages, const std::vector<cv::Mat> &masks) {
+        CV_Assert(masks.size() == refImages.size());
+        regions.clear();
+        regionOf.resize(refImages.size());
+        indexIn.resize(refImages.size());
+        std::vector<std::vector<cv::Mat> > packed;
+        // regions by hash of their mask, several only on a collision
+        std::unordered_map<uint64_t, std::vector<size_t> > byHash;
+        for(size_t i = 0; i < refImages.size(); i++) {
+            std::vector<size_t> &candidates = byHash[RoiMask::hash(masks[i])];
+            size_t c = 0;
+            while(c < candidates.size() && !regions[candidates[c]].same(masks[i]))
+                c++;
+            size_t r = c < candidates.size() ? candidates[c] : regions.size();
+            if(r == regions.size()) {
+                candidates.push_back(r);
+                regions.push_back(RoiMask(masks[i]));
+                packed.push_back(std::vector<cv::Mat>());
+            }
+            regionOf[i] = r;
+            indexIn[i] = packed[r].size();
+            packed[r].push_back(cv::Mat());
+            regions[r].pack(refImages[i], packed[r].back());
+        }
+        engines.resize(regions.size());
+        for(size_t r = 0; r < regions.size(); r++)
+            engines[r].setReferences(packed[r]);
+    }
+
+    // replaces reference i by img (whole, unpacked), keeping its mask
+    void setReference(int i, const cv::Mat &img) {
+        int r = regionOf[i];
+        cv::Mat packed;
+        regions[r].pack(img, packed);
+        engines[r].setReference(indexIn[i], packed);
+    }
+
+    int size() const {
+        return regionOf.size();
+    }
+
+    // only keeps the frame, see score()
+    void prepare(const cv::Mat &frame, Frame &out) const {
+        out.source = frame;
+        if(out.n_regions != regions.size()) {
+            out.n_regions = regions.size();
+            out.packed.resize(out.n_regions);
+            out.parts.resize(out.n_regions);
+            out.ready.reset(new std::atomic<bool>[out.n_regions]);
+            out.locks.reset(new std::mutex[out.n_regions]);
+        }
+        for(size_t r = 0; r < out.n_regions; r++)
+            out.ready[r] = false;
+    }
+
+    // packs and prepares the frame for the mask of ref if no thread did
+    // yet, then scores it
+    float score(const Frame &frame, int ref, Workspace &work, float floor) const {
+        int r = regionOf[ref];
+        if(!frame.ready[r].load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(frame.locks[r]);
+            if(!frame.ready[r].load(std::memory_order_relaxed)) {
+                regions[r].pack(frame.source, frame.packed[r]);
+                engines[r].prepare(frame.packed[r], frame.parts[r]);
+                frame.ready[r].store(true, std::memory_order_release);
+            }
+        }
+        return engines[r].score(frame.parts[r], indexIn[ref], work, floor);
+    }
+
+private:
+    std::vector<RoiMask> regions;
+    std::vector<Engine> engines; // per region
+    std::vector<int> regionOf;   // per reference
+    std::vector<int> indexIn;    // of the reference in its region engine
+};
+
+// reads a mask for frames of the given size. Returns false if it can't be
+// read or has no valid pixel
+inline bool loadMask(const std::string &path, cv::Size size, cv::Mat &mask)
+{
+    cv::Mat img = cv::imread(path, cv::IMREAD_GRAYSCALE);
+    if(img.empty())
+        return false;
+    if(img.size() != size)
+        cv::resize(img, img, size, 0, 0, cv::INTER_NEAREST);
+    cv::compare(img, 0, mask, cv::CMP_GT);
+    return cv::countNonZero(mask) > 0;
+}
+
+// file name without its directory and extension
+inline std::string fileStem(const std::string &path)
+{
+    size_t slash = path.find_last_of('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    return dot == std::string::npos || dot == 0 ? name : name.substr(0, dot);
+}
+
+// The mask of each reference of refPaths, at the given size: the file of
+// maskDir with the same stem as the reference, else the one of globalPath,
+// else the whole frame. Either path may be empty. Returns false, with the
+// path of the mask in error, if a mask can't be read or is empty
+inline bool loadReferenceMasks(const std::vector<std::string> &refPaths, const std::string &globalPath,
+                               const std::string &maskDir, cv::Size size, std::vector<cv::Mat> &masks,
+                               std::string &error)
+{
+    cv::Mat global(size, CV_8U, cv::Scalar(255));
+    if(!globalPath.empty() && !loadMask(globalPath, size, global)) {
+        error = globalPath;
+        return false;
+    }
+    std::map<std::string, std::string> byStem;
+    if(!maskDir.empty()) {
+        DIR *dir = opendir(maskDir.c_str());
+        if(!dir) {
+            error = maskDir;
+            return false;
+        }
+        std::vector<std::string> names;
+        while(dirent *entry = readdir(dir))
+            if(entry->d_name[0] != '.')
+                names.push_back(entry->d_name);
+        closedir(dir);
+        // first file in name order for a stem
+        std::sort(names.begin(), names.end());
+        for(size_t i = 0; i < names.size(); i++)
+            byStem.insert(std::make_pair(fileStem(names[i]), maskDir + "/" + names[i]));
+    }
+    masks.resize(refPaths.size());
+    for(size_t i = 0; i < refPaths.size(); i++) {
+        std::map<std::string, std::string>::const_iterator it = byStem.find(fileStem(refPaths[i]));
+        if(it == byStem.end()) {
+            masks[i] = global;
+        } else if(!loadMask(it->second, size, masks[i])) {
+            error = it->second;
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
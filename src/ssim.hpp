@@ -0,0 +1,131 @@
+// Structural similarity (SSIM) between a frame and the reference images,
+// as in VQMT::SSIM: 11x11 Gaussian window (sigma 1.5), statistics kept
+// where the window fits in the image ('valid'), and the mean of the SSIM
+// map. Color images are compared on their luma.
+//
+// VQMT::SSIM::computeSSIM allocates about 17 images per call and blurs
+// both sides every time. Here:
+//  - the mean and variance maps of the references (mu1, sigma1^2) are
+//    computed once, by setReferences();
+//  - the ones of the frame (mu2, sigma2^2) once per frame, by prepare();
+//  - each frame/reference comparison then costs one product image, one
+//    blur (for sigma12) and a single fused pass computing the SSIM map and
+//    its sum, in buffers of a per-thread SsimWorkspace that are only
+//    allocated on the first call.
+//
+// The images are converted to float before anything else (VQMT blurs the
+// 8-bit images and rounds mu to integers), so the scores match the
+// original Matlab implementation.
+//
+// Memory: each reference takes 3 float maps of its luma, 4 times the
+// 8-bit BGR image (3.5 MB for 640x480).
+
+#ifndef SSIM_ENGINE_HPP
+#define SSIM_ENGINE_HPP
+
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+
+float const SSIM_C1 = 6.5025f;  // (0.01 * 255)^2
+float const SSIM_C2 = 58.5225f; // (0.03 * 255)^2
+int const SSIM_WINDOW = 11;
+double const SSIM_SIGMA = 1.5;
+
+// buffers of one thread scoring with SsimEngine
+struct SsimWorkspace {
+    cv::Mat product, blurred;
+};
+
+// a frame prepared by SsimEngine::prepare()
+struct SsimFrame {
+    cv::Mat luma, mu, sigma_sq;
+    cv::Mat gray, tmp; // scratch
+};
+
+class SsimEngine {
+public:
+    typedef SsimFrame Frame;
+    typedef SsimWorkspace Workspace;
+
+    // the references must all have the same size and type as the frames
+    // that will be scored
+    void setReferences(const std::vector<cv::Mat> &refImages) {
+        refs.resize(refImages.size());
+        for(size_t i = 0; i < refImages.size(); i++)
+            setReference(i, refImages[i]);
+    }
+
+    void setReference(int i, const cv::Mat &img) {
+        SsimFrame tmp;
+        prepare(img, tmp);
+        refs[i].luma = tmp.luma;
+        refs[i].mu = tmp.mu;
+        refs[i].sigma_sq = tmp.sigma_sq;
+    }
+
+    int size() const {
+        return refs.size();
+    }
+
+    // luma as float, its local means and variances, once per frame
+    void prepare(const cv::Mat &frame, SsimFrame &out) const {
+        if(frame.channels() == 3) {
+            cv::cvtColor(frame, out.gray, cv::COLOR_BGR2GRAY);
+            out.gray.convertTo(out.luma, CV_32F);
+        } else {
+            frame.convertTo(out.luma, CV_32F);
+        }
+        int border = SSIM_WINDOW / 2;
+        cv::Range rows(border, out.luma.rows - border), cols(border, out.luma.cols - border);
+        cv::GaussianBlur(out.luma, out.tmp, cv::Size(SSIM_WINDOW, SSIM_WINDOW), SSIM_SIGMA);
+        out.tmp(rows, cols).copyTo(out.mu);
+        // sigma^2 = blur(x^2) - mu^2, on the valid part
+        cv::multiply(out.luma, out.luma, out.tmp);
+        cv::GaussianBlur(out.tmp, out.tmp, cv::Size(SSIM_WINDOW, SSIM_WINDOW), SSIM_SIGMA);
+        out.sigma_sq.create(out.mu.size(), CV_32F);
+        for(int y = 0; y < out.mu.rows; y++) {
+            const float *b = out.tmp.ptr<float>(y + border) + border;
+            const float *m = out.mu.ptr<float>(y);
+            float *s = out.sigma_sq.ptr<float>(y);
+            for(int x = 0; x < out.mu.cols; x++)
+                s[x] = b[x] - m[x] * m[x];
+        }
+    }
+
+    // mean SSIM between a prepared frame and a reference. Safe to call
+    // concurrently with a workspace per thread
+    float score(const SsimFrame &frame, int ref, SsimWorkspace &work, float) const {
+        const RefMaps &r = refs[ref];
+        cv::multiply(r.luma, frame.luma, work.product);
+        cv::GaussianBlur(work.product, work.blurred, cv::Size(SSIM_WINDOW, SSIM_WINDOW), SSIM_SIGMA);
+        int border = SSIM_WINDOW / 2;
+        double sum = 0.0;
+        for(int y = 0; y < r.mu.rows; y++) {
+            const float *mu1 = r.mu.ptr<float>(y);
+            const float *s1 = r.sigma_sq.ptr<float>(y);
+            const float *mu2 = frame.mu.ptr<float>(y);
+            const float *s2 = frame.sigma_sq.ptr<float>(y);
+            const float *b12 = work.blurred.ptr<float>(y + border) + border;
+            float row_sum = 0.0f;
+            for(int x = 0; x < r.mu.cols; x++) {
+                float mu12 = mu1[x] * mu2[x];
+                float sigma12 = b12[x] - mu12;
+                float num = (2.0f * mu12 + SSIM_C1) * (2.0f * sigma12 + SSIM_C2);
+                float den = (mu1[x] * mu1[x] + mu2[x] * mu2[x] + SSIM_C1) * (s1[x] + s2[x] + SSIM_C2);
+                row_sum += num / den;
+            }
+            sum += row_sum;
+        }
+        return sum / r.mu.total();
+    }
+
+private:
+    struct RefMaps {
+        cv::Mat luma, mu, sigma_sq;
+    };
+
+    std::vector<RefMaps> refs;
+};
+
+#endif
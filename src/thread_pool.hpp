@@ -0,0 +1,97 @@
+// Minimal pool of persistent worker threads. The pool does not manage a
+// task queue: run() hands the same function to every thread and waits for
+// all of them, and the caller splits the work inside that function (e.g.
+// with an atomic index). This keeps the per-call overhead to one wake-up,
+// which matters because the pool is used once per video frame.
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+    // n_threads counts the calling thread, so ThreadPool(1) spawns nothing
+    // and run() executes the task inline
+    explicit ThreadPool(int n_threads)
+        : n_threads(n_threads < 1 ? 1 : n_threads), generation(0), pending(0), stopping(false) {
+        for(int id = 1; id < this->n_threads; id++)
+            workers.emplace_back(&ThreadPool::worker_loop, this, id);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for(size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+    }
+
+    int size() const {
+        return n_threads;
+    }
+
+    // runs task(thread_id) once on every thread of the pool, the caller
+    // being thread 0, and returns when all of them are done
+    void run(const std::function<void(int)> &task) {
+        if(n_threads == 1) {
+            task(0);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            current_task = &task;
+            pending = n_threads - 1;
+            generation++;
+        }
+        work_ready.notify_all();
+        task(0);
+        std::unique_lock<std::mutex> lock(mtx);
+        work_done.wait(lock, [this] { return pending == 0; });
+        current_task = nullptr;
+    }
+
+    static int default_size() {
+        int n = std::thread::hardware_concurrency();
+        return n > 0 ? n : 1;
+    }
+
+private:
+    void worker_loop(int id) {
+        unsigned long seen_generation = 0;
+        while(true) {
+            const std::function<void(int)> *task;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                work_ready.wait(lock, [&] { return stopping || generation != seen_generation; });
+                if(stopping)
+                    return;
+                seen_generation = generation;
+                task = current_task;
+            }
+            (*task)(id);
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if(--pending == 0)
+                    work_done.notify_one();
+            }
+        }
+    }
+
+    int n_threads;
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::condition_variable work_ready, work_done;
+    const std::function<void(int)> *current_task = nullptr;
+    unsigned long generation;
+    int pending;
+    bool stopping;
+};
+
+#endif